@@ -0,0 +1,260 @@
+/* chatbench.c
+   Load generator for the chat server: opens many connections, broadcasts timestamped
+   messages at a target rate and measures delivery latency at every receiver. */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+#define PORT 9090
+#define BUF_SIZE 4096
+#define OUT_SIZE 256
+#define MAX_EVENTS 256
+#define MARK "@@b "           /* payload prefix: "@@b <send time ns>" */
+#define SUB_BITS 5            /* latency histogram: 32 linear sub-buckets per power of two */
+#define HIST_SIZE (64 << SUB_BITS)
+
+typedef struct {
+    int fd;
+    char in[BUF_SIZE];
+    size_t in_len;
+    char out[OUT_SIZE];       /* unsent tail of a message the socket wouldn't take whole */
+    size_t out_len;
+} conn_t;
+
+static conn_t *conns;
+static int nconns = 1000, nsenders = 10, rate = 1000, duration = 10, warmup_ms = 1000;
+static const char *host = "127.0.0.1";
+static int port = PORT;
+
+static uint64_t hist[HIST_SIZE];
+static uint64_t received, sent, skipped, disconnects;
+static uint64_t lat_max;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/* log-linear bucket: exact below 2^SUB_BITS ns, ~3% wide above */
+static int hist_bucket(uint64_t v) {
+    if (v < (1u << SUB_BITS)) return (int)v;
+    int msb = 63 - __builtin_clzll(v);
+    int shift = msb - SUB_BITS;
+    return ((shift + 1) << SUB_BITS) + (int)((v >> shift) & ((1u << SUB_BITS) - 1));
+}
+
+/* lower bound of a bucket, what percentiles report */
+static uint64_t hist_value(int b) {
+    if (b < (1 << SUB_BITS)) return (uint64_t)b;
+    int shift = (b >> SUB_BITS) - 1;
+    return ((uint64_t)(1u << SUB_BITS) + (uint64_t)(b & ((1 << SUB_BITS) - 1))) << shift;
+}
+
+static uint64_t percentile(double p) {
+    uint64_t want = (uint64_t)(p * (double)received), seen = 0;
+    for (int b = 0; b < HIST_SIZE; ++b) {
+        seen += hist[b];
+        if (seen > want && hist[b]) return hist_value(b);
+    }
+    return lat_max;
+}
+
+static void record(uint64_t lat) {
+    hist[hist_bucket(lat)]++;
+    if (lat > lat_max) lat_max = lat;
+    received++;
+}
+
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static int open_conn(const struct sockaddr_in *serv) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) { perror("socket"); return -1; }
+    if (connect(fd, (const struct sockaddr *)serv, sizeof(*serv)) < 0) { perror("connect"); close(fd); return -1; }
+    if (set_nonblocking(fd) < 0) { perror("fcntl"); close(fd); return -1; }
+    return fd;
+}
+
+static void conn_drop(int epfd, conn_t *c) {
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->fd = -1;
+    disconnects++;
+}
+
+/* read everything available; each line carrying MARK is one delivery */
+static void conn_readable(int epfd, conn_t *c, int measure) {
+    while (c->fd >= 0) {
+        ssize_t n = recv(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+        if (n <= 0) { conn_drop(epfd, c); return; }
+        c->in_len += (size_t)n;
+
+        uint64_t t = now_ns();
+        char *start = c->in, *end = c->in + c->in_len, *nl;
+        while ((nl = memchr(start, '\n', (size_t)(end - start)))) {
+            *nl = '\0';
+            char *m = measure ? strstr(start, MARK) : NULL;
+            if (m) {
+                uint64_t ts = strtoull(m + strlen(MARK), NULL, 10);
+                record(t > ts ? t - ts : 0);
+            }
+            start = nl + 1;
+        }
+        size_t rest = (size_t)(end - start);
+        if (rest == sizeof(c->in)) rest = 0; /* a line longer than the buffer isn't ours */
+        memmove(c->in, start, rest);
+        c->in_len = rest;
+    }
+}
+
+/* push out a pending tail; 0 when the connection is free for a new message */
+static int conn_flush(int epfd, conn_t *c) {
+    while (c->out_len) {
+        ssize_t n = send(c->fd, c->out, c->out_len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return -1;
+        if (n <= 0) { conn_drop(epfd, c); return -1; }
+        memmove(c->out, c->out + n, c->out_len - (size_t)n);
+        c->out_len -= (size_t)n;
+    }
+    return 0;
+}
+
+static void conn_send(int epfd, conn_t *c) {
+    if (c->fd < 0 || conn_flush(epfd, c) < 0) { skipped++; return; }
+    c->out_len = (size_t)snprintf(c->out, sizeof(c->out), MARK "%" PRIu64 "\n", now_ns());
+    sent++;
+    conn_flush(epfd, c);
+}
+
+/* run the event loop until deadline, sending on the first nsenders connections when pacing */
+static void run(int epfd, uint64_t deadline, int pace) {
+    struct epoll_event events[MAX_EVENTS];
+    uint64_t start = now_ns(), k = 0;
+    while (1) {
+        uint64_t t = now_ns();
+        if (t >= deadline) return;
+        if (pace > 0) {
+            uint64_t due = (t - start) * (uint64_t)rate / 1000000000ull;
+            for (; k < due; ++k) conn_send(epfd, &conns[k % (uint64_t)nsenders]);
+        }
+        int n = epoll_wait(epfd, events, MAX_EVENTS, 1);
+        if (n < 0 && errno != EINTR) { perror("epoll_wait"); return; }
+        for (int i = 0; i < n; ++i) {
+            conn_t *c = &conns[events[i].data.u32];
+            if (c->fd < 0) continue;
+            if (events[i].events & EPOLLOUT) conn_flush(epfd, c);
+            if (c->fd >= 0 && (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) conn_readable(epfd, c, pace >= 0);
+        }
+    }
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [options]\n"
+                    "  -H, --host ADDR       server address (default 127.0.0.1)\n"
+                    "  -p, --port N          server port (default %d)\n"
+                    "  -c, --conns N         connections, all of them receivers (default 1000)\n"
+                    "  -s, --senders N       connections that also send (default 10)\n"
+                    "  -r, --rate N          messages per second across all senders (default 1000)\n"
+                    "  -d, --duration SEC    measured sending time (default 10)\n"
+                    "  -w, --warmup MS       settle time after connecting, join notices discarded (default 1000)\n", prog, PORT);
+}
+
+int main(int argc, char *argv[]) {
+    static const struct option opts[] = {
+        { "host",     required_argument, NULL, 'H' },
+        { "port",     required_argument, NULL, 'p' },
+        { "conns",    required_argument, NULL, 'c' },
+        { "senders",  required_argument, NULL, 's' },
+        { "rate",     required_argument, NULL, 'r' },
+        { "duration", required_argument, NULL, 'd' },
+        { "warmup",   required_argument, NULL, 'w' },
+        { "help",     no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    int ch;
+    while ((ch = getopt_long(argc, argv, "H:p:c:s:r:d:w:h", opts, NULL)) != -1) {
+        switch (ch) {
+        case 'H': host = optarg; break;
+        case 'p': port = atoi(optarg); break;
+        case 'c': nconns = atoi(optarg); break;
+        case 's': nsenders = atoi(optarg); break;
+        case 'r': rate = atoi(optarg); break;
+        case 'd': duration = atoi(optarg); break;
+        case 'w': warmup_ms = atoi(optarg); break;
+        case 'h': usage(argv[0]); return 0;
+        default:  usage(argv[0]); return 1;
+        }
+    }
+    if (nconns < 2 || nsenders < 1 || rate < 1 || duration < 1) { usage(argv[0]); return 1; }
+    if (nsenders > nconns) nsenders = nconns;
+
+    /* thousands of sockets: lift the soft fd limit as far as the hard one allows */
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < (rlim_t)nconns + 16) {
+        rl.rlim_cur = rl.rlim_max < (rlim_t)nconns + 16 ? rl.rlim_max : (rlim_t)nconns + 16;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    struct sockaddr_in serv = {0};
+    serv.sin_family = AF_INET;
+    serv.sin_port = htons((uint16_t)port);
+    if (inet_pton(AF_INET, host, &serv.sin_addr) <= 0) { fprintf(stderr, "bad address: %s\n", host); return 1; }
+
+    conns = calloc((size_t)nconns, sizeof(*conns));
+    if (!conns) { perror("calloc"); return 1; }
+    int epfd = epoll_create1(0);
+    if (epfd < 0) { perror("epoll_create1"); return 1; }
+
+    for (int i = 0; i < nconns; ++i) {
+        conns[i].fd = open_conn(&serv);
+        if (conns[i].fd < 0) { fprintf(stderr, "connected %d of %d\n", i, nconns); return 1; }
+        struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.u32 = (uint32_t)i };
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, conns[i].fd, &ev) < 0) { perror("epoll_ctl"); return 1; }
+        if ((i & 63) == 63) run(epfd, now_ns(), -1); /* keep join notices from piling up in socket buffers */
+    }
+
+    /* settle: drain greetings and join notices without measuring */
+    run(epfd, now_ns() + (uint64_t)warmup_ms * 1000000ull, -1);
+
+    uint64_t t0 = now_ns();
+    run(epfd, t0 + (uint64_t)duration * 1000000000ull, 1);
+    uint64_t t1 = now_ns();
+    uint64_t sent_total = sent;
+    run(epfd, t1 + 1000000000ull, 0); /* one second for in-flight deliveries */
+
+    double secs = (double)(t1 - t0) / 1e9;
+    uint64_t expected = sent_total * (uint64_t)(nconns - 1);
+    printf("connections %d (senders %d), target %d msg/s for %d s\n", nconns, nsenders, rate, duration);
+    printf("sent        %" PRIu64 " msgs (%.0f msg/s), %" PRIu64 " skipped on backpressure\n", sent_total, (double)sent_total / secs, skipped);
+    printf("delivered   %" PRIu64 " of %" PRIu64 " (%.0f deliveries/s), %" PRIu64 " disconnects\n",
+           received, expected, (double)received / secs, disconnects);
+    if (received) {
+        printf("latency     p50 %.1f us  p99 %.1f us  p999 %.1f us  max %.1f us\n",
+               percentile(0.50) / 1e3, percentile(0.99) / 1e3, percentile(0.999) / 1e3, lat_max / 1e3);
+    }
+
+    for (int i = 0; i < nconns; ++i) if (conns[i].fd >= 0) close(conns[i].fd);
+    close(epfd);
+    free(conns);
+    return 0;
+}
@@ -1,94 +1,284 @@
-# backup current file
-cp client.c client.c.bak
-
-# overwrite with the fixed client.c
-cat > client.c <<'EOF'
 /* client.c
-   Threaded client for the multi-client chat server */
-#define _POSIX_C_SOURCE 200809L
+   Terminal client for the multi-client chat server: one poll loop over stdin and the socket.
+   --batch is the same loop for bots and bridges: stdin is read in blocks and every complete line in
+   a block goes out in one write, stdout is only flushed when the loop is about to sleep, and a lost
+   connection is redialled with backoff. */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <pthread.h>
+#include <getopt.h>
+#include <poll.h>
 #include <arpa/inet.h>
 #include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
 
 #define PORT 9090
 #define BUF_SIZE 4096
+#define BATCH_SIZE (64 * 1024) /* --batch: stdin block, and the most one write carries */
+#define BACKOFF_MIN_MS 100
+#define BACKOFF_MAX_MS 10000
 
 static int sockfd = -1;
+static SSL *ssl = NULL; /* --tls: every read and write goes through it */
+static volatile sig_atomic_t interrupted = 0;
 
-void *recv_thread(void *arg) {
-    (void)arg;   /* silence "unused parameter" warning */
+static void handle_sigint(int sig) {
+    (void)sig;
+    interrupted = 1;
+}
 
-    char buf[BUF_SIZE];
-    while (1) {
-        ssize_t n = recv(sockfd, buf, sizeof(buf) - 1, 0);
+/* bytes the connection took; less than len means it failed part way */
+static size_t conn_write(const char *buf, size_t len) {
+    if (ssl) return SSL_write(ssl, buf, (int)len) > 0 ? len : 0; /* all or nothing without partial writes */
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = send(sockfd, buf + done, len - done, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
         if (n <= 0) break;
-        buf[n] = '\\0';
-        printf("%s", buf);
-        fflush(stdout);
+        done += (size_t)n;
     }
-    fprintf(stderr, "\\n[Disconnected from server]\\n");
-    exit(0);
-    return NULL;
+    return done;
 }
 
-void handle_sigint(int sig) {
-    (void)sig;
-    if (sockfd != -1) {
-        const char *q = "/quit\\n";
-        send(sockfd, q, strlen(q), 0);
-        close(sockfd);
+static ssize_t conn_read(char *buf, size_t len) {
+    if (ssl) {
+        int n = SSL_read(ssl, buf, (int)len);
+        return n > 0 ? n : -1;
     }
-    printf("\\n[Client exiting]\\n");
-    exit(0);
+    return recv(sockfd, buf, len, 0);
 }
 
-int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <server_ip>\\n", argv[0]);
-        return 1;
+/* TLS client: the handshake and records stay in userspace; the server's certificate must match ip */
+static SSL *tls_connect(int fd, const char *ip, const char *ca) {
+    SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+    if (!ctx) return NULL;
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+    if ((ca ? SSL_CTX_load_verify_locations(ctx, ca, NULL) : SSL_CTX_set_default_verify_paths(ctx)) != 1) {
+        SSL_CTX_free(ctx);
+        return NULL;
     }
-    const char *server_ip = argv[1];
-    struct sockaddr_in serv;
-
-    signal(SIGINT, handle_sigint);
-
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd < 0) { perror("socket"); return 1; }
+    SSL *s = SSL_new(ctx);
+    SSL_CTX_free(ctx); /* the SSL keeps its own reference */
+    if (!s || !SSL_set_fd(s, fd) || !X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(s), ip) || SSL_connect(s) != 1) {
+        SSL_free(s);
+        return NULL;
+    }
+    return s;
+}
 
+/* connect (and handshake with --tls); -1 with the reason already printed */
+static int dial(const char *ip, int port, int tls, const char *ca) {
+    struct sockaddr_in serv;
     memset(&serv, 0, sizeof(serv));
     serv.sin_family = AF_INET;
-    serv.sin_port = htons(PORT);
-    if (inet_pton(AF_INET, server_ip, &serv.sin_addr) <= 0) { perror("inet_pton"); close(sockfd); return 1; }
+    serv.sin_port = htons((uint16_t)port);
+    if (inet_pton(AF_INET, ip, &serv.sin_addr) <= 0) { fprintf(stderr, "inet_pton: bad address %s\n", ip); return -1; }
+
+    sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sockfd < 0) { perror("socket"); return -1; }
+    if (connect(sockfd, (struct sockaddr *)&serv, sizeof(serv)) < 0) { perror("connect"); close(sockfd); sockfd = -1; return -1; }
+    if (tls && !(ssl = tls_connect(sockfd, ip, ca))) {
+        ERR_print_errors_fp(stderr);
+        fprintf(stderr, "TLS handshake failed\n");
+        close(sockfd);
+        sockfd = -1;
+        return -1;
+    }
+    return 0;
+}
 
-    if (connect(sockfd, (struct sockaddr *)&serv, sizeof(serv)) < 0) { perror("connect"); close(sockfd); return 1; }
+static void hang_up(void) {
+    if (ssl) { SSL_shutdown(ssl); SSL_free(ssl); ssl = NULL; }
+    if (sockfd >= 0) close(sockfd);
+    sockfd = -1;
+}
 
-    printf("✅ Connected to %s:%d\\n", server_ip, PORT);
-    printf("Type messages. Commands: /name <new>, /list, /msg <id> <text>, /quit\\n");
+/* sleep ms unless SIGINT arrives first */
+static void nap(int ms) {
+    struct timespec ts = { ms / 1000, (long)(ms % 1000) * 1000000L };
+    while (!interrupted && nanosleep(&ts, &ts) < 0 && errno == EINTR) {}
+}
 
-    pthread_t rt;
-    if (pthread_create(&rt, NULL, recv_thread, NULL) != 0) {
-        perror("pthread_create");
-        close(sockfd);
-        return 1;
+/* --batch: a server PING line (sent to quiet clients with --ping) gets "/pong", so a bot that only
+   listens isn't timed out. line holds the start of the current received line across reads. */
+static int saw_ping(const char *buf, size_t n, char line[5], size_t *ll) {
+    int ping = 0;
+    for (size_t i = 0; i < n; ++i) {
+        if (buf[i] == '\n') {
+            ping |= *ll == 4 && memcmp(line, "PING", 4) == 0;
+            *ll = 0;
+        } else if (*ll < 5) {
+            line[(*ll)++] = buf[i];
+        }
     }
+    return ping;
+}
 
-    char line[BUF_SIZE];
-    while (fgets(line, sizeof(line), stdin) != NULL) {
-        size_t len = strlen(line);
-        if (len == 0) continue;
-        if (send(sockfd, line, len, 0) <= 0) {
-            perror("send");
+/* --batch: nothing is echoed or prompted, status goes to stderr, and a dropped connection is dialled
+   again (BACKOFF_MIN_MS doubling to BACKOFF_MAX_MS, back to the minimum once the server has said
+   something) until stdin ends or SIGINT. Lines the socket took are not sent again, the one it took
+   only part of is dropped rather than finished on the next connection, and the rest wait. */
+static int run_batch(const char *ip, int port, int tls, const char *ca) {
+    static char in[BATCH_SIZE], rx[BATCH_SIZE];
+    static char out[1 << 16];
+    size_t in_len = 0, ll = 0;
+    char line[5];
+    int eof = 0, backoff = BACKOFF_MIN_MS, dials = 0;
+    setvbuf(stdout, out, _IOFBF, sizeof(out));
+
+    while (!interrupted) {
+        if (sockfd < 0) {
+            if (dials++) {
+                fflush(stdout);
+                fprintf(stderr, "[reconnecting in %d ms]\n", backoff);
+                nap(backoff);
+                backoff = backoff * 2 > BACKOFF_MAX_MS ? BACKOFF_MAX_MS : backoff * 2;
+                if (interrupted) break;
+            }
+            if (dial(ip, port, tls, ca) < 0) continue;
+            ll = 0;
+            fprintf(stderr, "[connected to %s:%d%s]\n", ip, port, ssl ? " (TLS)" : "");
+        }
+
+        /* every complete line read so far goes out in one write; so does a block with no newline at all */
+        char *cut = in_len ? memrchr(in, '\n', in_len) : NULL;
+        size_t n = cut ? (size_t)(cut - in) + 1 : in_len == sizeof(in) ? in_len : 0;
+        if (n) {
+            size_t sent = conn_write(in, n);
+            if (sent < n) {
+                /* whole lines the socket took are gone; so is the one it was part way through */
+                char *nl = sent ? memrchr(in, '\n', sent) : NULL;
+                size_t drop = nl ? (size_t)(nl - in) + 1 : 0;
+                if (sent > drop) {
+                    char *end = memchr(in + sent, '\n', in_len - sent);
+                    drop = end ? (size_t)(end - in) + 1 : in_len;
+                    fprintf(stderr, "[send failed, line dropped]\n");
+                }
+                memmove(in, in + drop, in_len - drop);
+                in_len -= drop;
+                hang_up();
+                continue;
+            }
+            memmove(in, in + n, in_len - n);
+            in_len -= n;
+        }
+        if (eof && !in_len) {
+            conn_write("/quit\n", 6);
             break;
         }
-        if (strncmp(line, "/quit", 5) == 0) break;
+
+        struct pollfd pfd[2] = { { .fd = sockfd, .events = POLLIN },
+                                 { .fd = eof || in_len == sizeof(in) ? -1 : STDIN_FILENO, .events = POLLIN } };
+        int ready = ssl && SSL_pending(ssl) ? 1 : poll(pfd, 2, 0);
+        if (ready == 0) {
+            fflush(stdout); /* about to sleep: whatever arrived is shown now, not per read */
+            ready = poll(pfd, 2, -1);
+        }
+        if (ready < 0) continue;
+        if ((ssl && SSL_pending(ssl)) || (pfd[0].revents & (POLLIN | POLLHUP | POLLERR))) {
+            ssize_t r = conn_read(rx, sizeof(rx));
+            if (r <= 0) {
+                fflush(stdout);
+                fprintf(stderr, "[disconnected]\n");
+                hang_up();
+                continue;
+            }
+            backoff = BACKOFF_MIN_MS; /* it answered, so it isn't just accepting and dropping */
+            fwrite(rx, 1, (size_t)r, stdout);
+            if (saw_ping(rx, (size_t)r, line, &ll) && conn_write("/pong\n", 6) < 6) { hang_up(); continue; }
+        }
+        if (pfd[1].revents & (POLLIN | POLLHUP)) {
+            ssize_t r = read(STDIN_FILENO, in + in_len, sizeof(in) - in_len);
+            if (r > 0) in_len += (size_t)r;
+            else if (r == 0 || errno != EINTR) {
+                eof = 1;
+                if (in_len && in[in_len - 1] != '\n' && in_len < sizeof(in)) in[in_len++] = '\n';
+            }
+        }
     }
 
-    close(sockfd);
+    if (interrupted && sockfd >= 0) conn_write("/quit\n", 6);
+    fflush(stdout);
+    hang_up();
     return 0;
 }
-EOF
 
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [options] <server_ip>\n"
+                    "  -p, --port N    server port (default %d)\n"
+                    "      --tls       connect with TLS\n"
+                    "      --ca FILE   trust this PEM certificate (default: the system store)\n"
+                    "  -b, --batch     non-interactive: batched stdin, buffered stdout, reconnect on loss\n",
+            prog, PORT);
+}
+
+int main(int argc, char *argv[]) {
+    static const struct option opts[] = {
+        { "port", required_argument, NULL, 'p' },
+        { "tls",  no_argument,       NULL, 't' },
+        { "ca",   required_argument, NULL, 'a' },
+        { "batch", no_argument,      NULL, 'b' },
+        { "help", no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    int port = PORT, tls = 0, batch = 0, ch;
+    const char *ca = NULL;
+    while ((ch = getopt_long(argc, argv, "p:bh", opts, NULL)) != -1) {
+        switch (ch) {
+        case 'p': port = atoi(optarg); break;
+        case 't': tls = 1; break;
+        case 'a': ca = optarg; break;
+        case 'b': batch = 1; break;
+        case 'h': usage(argv[0]); return 0;
+        default:  usage(argv[0]); return 1;
+        }
+    }
+    if (optind != argc - 1) { usage(argv[0]); return 1; }
+    const char *server_ip = argv[optind];
+
+    struct sigaction sa = { .sa_handler = handle_sigint }; /* no SA_RESTART: poll returns EINTR */
+    sigaction(SIGINT, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN); /* SSL_write to a closed peer */
+
+    if (batch) return run_batch(server_ip, port, tls, ca);
+    if (dial(server_ip, port, tls, ca) < 0) return 1;
+
+    printf("✅ Connected to %s:%d%s\n", server_ip, port, ssl ? " (TLS)" : "");
+    printf("Type messages. Commands: /name <new>, /list, /msg <id> <text>, /quit\n");
+
+    setvbuf(stdin, NULL, _IONBF, 0); /* no line may sit in a stdio buffer that poll cannot see */
+    char buf[BUF_SIZE];
+    struct pollfd pfd[2] = { { .fd = sockfd, .events = POLLIN }, { .fd = STDIN_FILENO, .events = POLLIN } };
+    while (!interrupted) {
+        /* SSL_read may have decrypted more than it returned; that never shows up in poll */
+        if (!(ssl && SSL_pending(ssl)) && poll(pfd, 2, -1) < 0) continue;
+        if ((ssl && SSL_pending(ssl)) || (pfd[0].revents & (POLLIN | POLLHUP | POLLERR))) {
+            ssize_t n = conn_read(buf, sizeof(buf) - 1);
+            if (n <= 0) { fprintf(stderr, "\n[Disconnected from server]\n"); return 0; }
+            fwrite(buf, 1, (size_t)n, stdout);
+            fflush(stdout);
+        }
+        if (pfd[1].revents & (POLLIN | POLLHUP)) {
+            pfd[1].revents = 0;
+            if (!fgets(buf, sizeof(buf), stdin)) break;
+            size_t len = strlen(buf);
+            if (len == 0) continue;
+            if (conn_write(buf, len) < len) { perror("send"); break; }
+            if (strncmp(buf, "/quit", 5) == 0) break;
+        }
+        pfd[0].revents = 0;
+    }
+
+    if (interrupted) {
+        conn_write("/quit\n", 6);
+        printf("\n[Client exiting]\n");
+    }
+    hang_up();
+    return 0;
+}
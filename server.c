@@ -1,7 +1,7 @@
 // server.c
-// Final optimized multi-client chat server (threads). Safe string ops, logging, graceful shutdown.
+// Final optimized multi-client chat server (epoll event loops, one per worker). Safe string ops, logging, graceful shutdown.
 
-#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,61 +10,718 @@
 #include <signal.h>
 #include <errno.h>
 #include <time.h>
+#include <getopt.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <pthread.h>
 #include <stdint.h>
 #include <inttypes.h>
+#include <stdatomic.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <zlib.h>
 
 #define PORT 9090
-#define MAX_CLIENTS 128
+#define MAX_CLIENTS_DEFAULT 1024 /* server-wide, --max-clients */
+#define CLIENT_CHUNK 256 /* slab growth step per shard; power of two */
+#define MAX_WORKERS 64
 #define BUF_SIZE 4096
 #define NAME_LEN 32
-#define BACKLOG 16
+#define MAX_ROOMS 1024 /* once full, the id of the room longest empty is reused and its history dropped */
+#define ROOMS_PER_ADDR 8 /* rooms one client address may create with /join in a burst... */
+#define ROOM_CREATE_MS 60000 /* ...and then one per this long */
+#define ROOM_QUOTA_SLOTS 1024 /* per-address creation buckets, a power of two; addresses that hash together share one */
+#define LOBBY 0 /* room every client starts in and /leave returns to */
+#define HISTORY_DEFAULT 50 /* chat lines kept per room, --history */
+#define BACKLOG 16 /* metrics and cluster listeners */
+#define LISTEN_BACKLOG_DEFAULT 4096 /* client listener, --backlog; the kernel caps it at somaxconn */
+#define MAX_EVENTS 64
+#define SEND_TIMEOUT_MS 1000
+#define IOV_BATCH 64 /* queued messages coalesced into one sendmsg */
+#define OUTQ_MIN 8 /* output ring slots lent to a client with anything queued; power of two */
+#define POOL_SPARE 256 /* idle buffers a worker keeps per pool before handing them back to malloc */
+#define OUT_HIGH_DEFAULT (1024 * 1024) /* pending output bytes per client */
+#define LOG_RING_SIZE 4096 /* log records in flight; power of two */
+#define LOG_LINE_MAX 1024 /* longer records are truncated */
+#define LOG_BATCH_BYTES (64 * 1024)
+#define LOG_INTERVAL_DEFAULT 100 /* ms */
+#define JOURNAL_SEG_DEFAULT 64 /* MiB per preallocated segment, --journal-seg-mb */
+#define JOURNAL_QUEUE 8192 /* records waiting for the journal thread; a full queue drops */
+#define JOURNAL_LOAD_SEGS 2 /* newest segments replayed into room history at startup */
+#define FANOUT_BUCKETS 24 /* fan-out histogram: bucket i < 2^(i+8) ns, the last is +Inf */
+#define URING_ENTRIES 1024 /* submission queue per worker; the completion queue is 4x */
+#define URING_BUFS 1024 /* provided recv buffers of BUF_SIZE per worker; power of two */
+#define LISTEN_TAG UINT64_MAX
+#define WAKE_TAG (UINT64_MAX - 1)
+#define TIMER_TAG (UINT64_MAX - 2)
+#define DRAIN_MS_DEFAULT 2000 /* shutdown and handoff: how long queued output gets to leave, --drain-ms */
+#define HANDOFF_MAGIC "CHR1"
+#define HANDOFF_BATCH 64 /* client fds per SCM_RIGHTS message */
+#define HANDOFF_MSG (64 * 1024) /* bytes of client records per message */
+#define TICK_MS 100 /* timer wheel resolution */
+#define TLS_TIMEOUT_DEFAULT 10 /* seconds a TLS handshake may take, --tls-timeout */
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS) /* buckets per level */
+#define WHEEL_LEVELS 4 /* 64^4 ticks, about 19 days at TICK_MS; longer deadlines are clamped */
+
+/* Binary framing (opt-in): a connection whose first byte is 0x00 speaks frames instead of lines.
+ *   0  u8   type      FRAME_*
+ *   1  u8   flags     FRAME_F_*
+ *   2  u16  raw_len   with FRAME_F_DEFLATE, the payload's inflated length; FRAME_CHUNK's stream; otherwise 0
+ *   4  u32  length    payload bytes
+ *   8  i64  id        sender id (server->client), target id (client->server FRAME_PM)
+ *  16  ...  payload
+ * Integers are big-endian. The client opens with FRAME_HELLO carrying FRAME_MAGIC (once: a second one
+ * closes the connection) and the server answers FRAME_HELLO with the client's id and name as payload.
+ * The text greeting sent before that answer never contains a NUL byte, so a client skips to the first 0x00. Server->client FRAME_MSG
+ * and FRAME_PM payloads are [u8 name_len][name][text]; FRAME_LIST is repeated [i64 id][u8 name_len][name];
+ * FRAME_SERVER carries a notice without its trailing newline. FRAME_JOIN carries a room name;
+ * FRAME_LEAVE returns to the lobby. FRAME_MSG goes to the sender's room only. FRAME_HISTORY asks for
+ * the room's last <id> messages, which arrive as the FRAME_MSGs they were; the same replay follows the
+ * FRAME_HELLO answer and every join (the replay in the text greeting is skipped with the rest of it).
+ * With --ping the server sends FRAME_PING ("PING\n" to text clients) after a quiet interval; any input
+ * answers it, FRAME_PONG or "/pong" being the ones that do nothing else.
+ * A client that sets FRAME_F_DEFLATE on its FRAME_HELLO may be sent FRAME_MSGs of --compress-min bytes
+ * or more with that flag set and a raw deflate (RFC 1951, no zlib header) payload, compressed
+ * against the preset dictionary ZIP_DICT; the answering FRAME_HELLO has the flag set if the server
+ * agreed. Each message is a complete deflate stream on its own.
+ * Anything too big for one frame is streamed as FRAME_CHUNKs to the sender's room: the client numbers
+ * the transfer (u16 at offset 2; several may be open at once, between ordinary frames) and sets
+ * FRAME_F_MORE on every chunk but the last. Each chunk is relayed as it arrives, with the sender's id
+ * and the FRAME_MSG payload layout, and is never deflated, kept in history or journalled. Recipients
+ * get chunks behind their other output and within a budget of --out-low queued chunk bytes: a chunk
+ * that doesn't fit ends that transfer for them with an empty FRAME_F_ABORT chunk, after which the rest
+ * of it is discarded. The whole room gets that abort if the sender leaves the room or the server
+ * mid-transfer, or the rate limiter refuses a piece. A client may have CHUNK_STREAMS transfers open;
+ * starting another closes the connection. A text line longer than the input buffer is streamed the same way (stream 0);
+ * text recipients see every chunk as a chat line of its own. */
+#define FRAME_HDR 16
+#define FRAME_MAGIC "CHB1"
+#define FRAME_F_DEFLATE 0x01
+#define FRAME_F_MORE 0x02 /* FRAME_CHUNK: more of this transfer follows */
+#define FRAME_F_ABORT 0x04 /* FRAME_CHUNK: transfer cut short for this recipient */
+#define CHUNK_STREAMS 8 /* transfers one client may have open at once; more closes the connection */
+#define CHUNK_CUTS 4 /* transfers one recipient can have cut off at once; past that, chunks exceed the budget */
+#define ZIP_MIN_DEFAULT 256 /* smallest FRAME_MSG payload worth compressing, --compress-min */
+#define ZIP_WBITS 12 /* 4 KB window: a payload never exceeds BUF_SIZE */
+/* preset dictionary, most frequent strings last; clients must use the same bytes */
+#define ZIP_DICT "https://www. .com/ .org/ .html?id= we they there their would could should about " \
+                 "because really think know what when where which have this that with from your " \
+                 "just like will been were them then than into only also some more time people " \
+                 "please thanks sorry yes okay lol the and for are but not you all can was " \
+                 "[Server]  joined.  disconnected.  is now known as  (ID:"
+enum { FRAME_HELLO, FRAME_MSG, FRAME_PM, FRAME_NAME, FRAME_LIST, FRAME_QUIT, FRAME_SERVER, FRAME_STATS, FRAME_JOIN, FRAME_LEAVE, FRAME_HISTORY, FRAME_PING, FRAME_PONG, FRAME_CHUNK };
+enum { PROTO_UNKNOWN, PROTO_TEXT, PROTO_BINARY };
+
+/* immutable, reference-counted message; one per broadcast, shared by every queue it lands in */
+typedef struct {
+    atomic_int refs;
+    uint8_t bulk;                  /* FRAME_CHUNK: queued behind other output, within its own budget */
+    size_t len;
+    char data[];
+} msgbuf_t;
+
+/* one logical message rendered once per protocol; each rendering is shared by all its recipients */
+typedef struct {
+    msgbuf_t *text;
+    msgbuf_t *bin;
+    msgbuf_t *zbin; /* bin deflated for FRAME_F_DEFLATE clients; NULL when nobody needs it or it didn't shrink */
+} outmsg_t;
+
+/* hot per-connection state: everything a fan-out touches, packed into one cache line.
+   Owned by its worker's event loop, no per-client thread. */
+typedef struct {
+    int fd;
+    uint8_t alive;
+    uint8_t proto;                 /* PROTO_*, fixed by the first byte the client sends */
+    uint8_t queued;                /* on the worker's flush list */
+    uint8_t dropping;              /* SLOW_DROP_NEWEST: over the high mark, shedding until below the low mark */
+    uint8_t evict;                 /* SLOW_DISCONNECT: close on the next flush */
+    uint8_t tx_busy;               /* io_uring: a send is in flight */
+    uint8_t handshake;             /* TLS: still handshaking in userspace, so nothing may be written yet */
+    uint8_t deflate;               /* binary client that negotiated FRAME_F_DEFLATE */
+    uint32_t out_prio;             /* leading entries other output queues behind; chunks after them wait */
+    int64_t id;
+    msgbuf_t **outq;               /* ring of pending messages, written when the socket is writable */
+    uint32_t out_cap, out_head, out_count;
+    uint32_t bulk_bytes;           /* queued FRAME_CHUNK bytes, kept within out_low */
+    size_t out_off;                /* bytes of outq[out_head] already sent */
+    size_t out_bytes;              /* unsent bytes across the whole queue */
+} client_t;
+_Static_assert(sizeof(client_t) <= 64, "client_t must stay within one cache line");
+
+struct uring_tx;
+
+/* a sender's text prefixes, rendered on its first message and dropped on /name, so chat and PMs are
+   assembled with memcpy instead of snprintf */
+typedef struct {
+    uint8_t chat_len, pm_len;
+    char chat[NAME_LEN + 32];      /* "name (ID:n): " */
+    char pm[NAME_LEN + 40];        /* "[PM from name (ID:n)]: " */
+} sender_hdr_t;
+
+/* cold per-connection state: only touched by the client's own input, by /list and by chunk fan-out */
+typedef struct {
+    char name[NAME_LEN];
+    sender_hdr_t *hdr;             /* NULL until the client first talks, and again after a rename */
+    char *in;                      /* BUF_SIZE input buffer from the worker's pool; NULL while nothing is buffered */
+    size_t in_len;
+    int live_idx;                  /* position in the worker's live list, -1 until seated */
+    int room;                      /* room id, -1 before the client is seated */
+    int room_idx;                  /* position in the shard's member list for that room */
+    struct uring_tx *tx;           /* io_uring: send state from the worker's pool, held while output is pending */
+    SSL *tls;                      /* TLS handshake state; freed once the keys are in the kernel */
+    uint64_t last_rx;              /* wheel tick of the last input */
+    uint64_t tat_msgs, tat_bytes;  /* rate limits: when each bucket is full again (GCRA), CLOCK_MONOTONIC ns */
+    uint8_t limited;               /* told about the limit since its last accepted message */
+    uint8_t streaming;             /* text: the line being read has already gone out in part, as stream 0 */
+    uint8_t greeted;               /* binary: FRAME_HELLO answered; it isn't rate limited, so only once */
+    uint8_t nxfer;                 /* open transfers this client is sending */
+    uint8_t xfer_cut;              /* bit i: xfer[i] was aborted, the rest of it is dropped */
+    uint16_t xfer[CHUNK_STREAMS];  /* their stream numbers */
+    struct { int64_t from; int stream; } cut[CHUNK_CUTS]; /* transfers this client gets no more of; stream -1 = free */
+    int tnext, tprev;              /* timer wheel bucket list, by slot */
+    int tbucket;                   /* level * WHEEL_SIZE + index, -1 = not armed */
+} client_cold_t;
+
+/* slab chunk: hot and cold halves kept in separate arrays */
+typedef struct {
+    client_t hot[CLIENT_CHUNK];
+    client_cold_t cold[CLIENT_CHUNK];
+} client_chunk_t;
+
+/* what to do when a client's pending output crosses the high watermark */
+enum { SLOW_DROP_OLDEST, SLOW_DROP_NEWEST, SLOW_DISCONNECT };
+
+/* one slot of the log ring; seq tells producers and the writer whose turn the slot is */
+typedef struct {
+    atomic_size_t seq;
+    time_t ts;
+    size_t len;
+    char text[LOG_LINE_MAX];
+} log_rec_t;
+
+/* when the writer thread hands its batch to write(2) */
+enum { LOG_FLUSH_RECORDS, LOG_FLUSH_INTERVAL, LOG_FLUSH_SHUTDOWN };
+
+/* Journal (--journal DIR): chat messages appended to DIR/journal-NNNNNNNN.seg, each segment preallocated
+ * and written through a shared mapping by one background thread. A record is a jrec_t, then room_len
+ * bytes of room name, then the FRAME_MSG payload ([u8 name_len][name][text]), padded to 8 bytes.
+ * Fields are host byte order; a zero magic marks the end of a segment's records. */
+#define JREC_MAGIC 0x314a4843u /* "CHJ1" */
+typedef struct {
+    uint32_t magic;
+    uint32_t len;   /* bytes after the header, before padding */
+    int64_t ts;     /* CLOCK_REALTIME, ns */
+    int64_t id;     /* sender */
+    uint8_t room_len;
+    uint8_t pad[7];
+} jrec_t;
+
+typedef struct {
+    msgbuf_t *bin;  /* the broadcast's FRAME_MSG rendering, referenced rather than copied */
+    char room[NAME_LEN]; /* copied: the id may name another room by the time it is written */
+    int64_t ts;
+} jent_t;
+
+/* a room's recent chat, holding references to the very buffers its broadcasts went out in */
+typedef struct {
+    pthread_mutex_t mtx;
+    outmsg_t *ring; /* history_len entries, allocated on the room's first message */
+    uint32_t head, count;
+} room_hist_t;
+
+/* Cluster (--node N): every node dials every --peer and reads what its --cluster-port accepts from a
+ * --peer address, so each ordered pair of nodes shares one one-way TCP link. A link record is [u8 kind][u8 room_len][u16 0]
+ * [u32 frame_len][i64 to], room_len bytes of room name, then one binary-protocol frame: the very bytes
+ * local binary clients get. Client ids carry their node in the low NODE_BITS, which is the whole
+ * id -> node directory /msg needs. Integers are big-endian, as in client frames. */
+#define NODE_BITS 4
+#define MAX_NODES (1 << NODE_BITS)
+#define LINK_HDR 16
+#define LINK_MAGIC "CHN1"
+#define LINK_BUF_MAX (8 << 20) /* bytes queued for one peer before records are dropped */
+#define LINK_IN_BUF (64 * 1024) /* largest record a node accepts */
+#define LINK_IN_MAX (2 * MAX_NODES)
+#define LINK_RETRY_MS 1000
+enum { LINK_HELLO, LINK_ALL, LINK_ROOM, LINK_TO };
+
+/* outbound link to one peer. Workers append records to buf while the cluster thread writes the
+   previous batch from out, so a busy link costs one write per batch rather than per message. */
+typedef struct {
+    int node;
+    struct sockaddr_in addr;
+    pthread_mutex_t mtx;
+    int up;                  /* connected and greeted; records queue only while set */
+    char *buf;               /* records waiting for the next batch */
+    size_t len, cap;
+    /* cluster thread only */
+    int fd, connecting;
+    char *out;
+    size_t out_len, out_off, out_cap;
+    uint64_t retry_at;
+} peer_t;
 
 typedef struct {
     int fd;
-    int alive;
+    int greeted;
+    struct in_addr from; /* the greeting must name a peer at this address */
+    char *buf;
+    size_t len;
+} link_in_t;
+
+/* Hot restart: the successor connects to the --handoff socket (SOCK_SEQPACKET). The first message is a
+ * handoff_hdr_t carrying the listening sockets; each following one carries up to HANDOFF_BATCH client
+ * sockets and their handoff_rec_t, each record followed by in_len bytes of unparsed input. The old
+ * process exits once everything is sent; EOF tells the successor its ports and files are free. */
+typedef struct {
+    char magic[4];
+    uint32_t nlisten, nclients;
+    int64_t next_id;
+} handoff_hdr_t;
+
+typedef struct {
     int64_t id;
+    uint32_t in_len;
+    uint8_t proto;
+    uint8_t deflate;
+    uint8_t streaming; /* text: the buffered line has already gone out in part */
+    uint8_t greeted;
+    char name[NAME_LEN];
+    char room[NAME_LEN];
+} handoff_rec_t;
+
+typedef struct {
+    int fd;
+    handoff_rec_t rec;
+    char *in;
+} adopted_t;
+
+/* one room's members on one shard; only the owning worker touches it */
+typedef struct {
+    int *slots;
+    int n, cap;
+} room_members_t;
+
+/* fixed-size blocks lent to connections only while they have I/O in flight, so an idle connection
+   holds nothing beyond its slab slot; owned by one worker, no locking */
+typedef struct {
+    size_t size;
+    int n;
+    void *spare[POOL_SPARE];
+} pool_t;
+
+/* cross-worker delivery, queued on the target worker's inbox */
+enum { MAIL_BROADCAST, MAIL_ROOM, MAIL_DELIVER };
+
+typedef struct mail {
+    struct mail *next;
+    int kind;
+    int slot;      /* MAIL_DELIVER: target slot; MAIL_ROOM: room id */
+    int64_t id;    /* MAIL_DELIVER: target id (slot may have been reused); MAIL_ROOM: room_gen */
+    int except_fd; /* MAIL_BROADCAST: fd to skip (-1 = none); fds are process-wide */
+    outmsg_t msg;  /* references owned by the mail */
+} mail_t;
+
+/* per-worker counters, indices into worker_t.stats; ST_OUT_QUEUED is a gauge */
+enum {
+    ST_ACCEPTS, ST_MSGS_IN, ST_MSGS_OUT, ST_BYTES_IN, ST_BYTES_OUT, ST_OUT_QUEUED,
+    ST_LOCK_WAITS, ST_LOCK_WAIT_NS, ST_FANOUTS, ST_FANOUT_NS, ST_ZIP_OUT, ST_ZIP_SAVED,
+    ST_FANOUT_HIST, ST_COUNT = ST_FANOUT_HIST + FANOUT_BUCKETS
+};
+
+/* one event loop: own listening socket (SO_REUSEPORT), own shard of clients */
+typedef struct {
+    int index;
     pthread_t thread;
+    int epoll_fd;
+    int listen_fd;
+    int wake_fd;
+    pthread_mutex_t inbox_mtx;
+    mail_t *inbox_head, *inbox_tail;
+    client_chunk_t **chunks; /* slab; grows CLIENT_CHUNK slots at a time under clients_mtx */
+    int nchunks;
+    int *live;               /* dense list of live slots; broadcasts walk this, not the slab */
+    int nlive;
+    int *flush_list;         /* slots with output queued since the last flush */
+    int nflush;
+    int *free_slots;         /* stack of unused slots */
+    int nfree;
+    room_members_t *rooms;   /* indexed by room id, grown on first use */
+    int rooms_cap;
+    int stopping;            /* has stopped accepting (and for a handoff, reading) */
+    int cancels;             /* io_uring: cancellations not yet completed */
+    int timer_fd;            /* TICK_MS timerfd, -1 when there is no --idle-timeout, --ping or TLS */
+    uint64_t tick;
+    int wheel[WHEEL_LEVELS * WHEEL_SIZE]; /* bucket heads (slots), -1 = empty */
+    struct uring *ring;      /* io_uring backend; NULL = epoll */
+    pool_t in_pool;          /* BUF_SIZE input buffers */
+    pool_t outq_pool;        /* OUTQ_MIN-slot output rings */
+    pool_t tx_pool;          /* io_uring send state */
+    atomic_uint_fast64_t rcu_seen; /* epoch at the last quiescent state; 0 while parked in epoll_wait */
+    /* written only by this worker, summed by readers (/stats, metrics port); own cache lines */
+    _Alignas(64) atomic_uint_fast64_t stats[ST_COUNT];
+} worker_t;
+
+/* id -> owning shard, slot and name. Readers (/msg lookup, /list) walk it without a lock; writers hold
+   clients_mtx, never modify a published entry or table, and retire what they replace (see rcu_retire). */
+typedef struct {
+    int64_t id;
+    int worker;
+    int slot;
     char name[NAME_LEN];
-} client_t;
+} dir_entry_t;
 
-static client_t clients[MAX_CLIENTS];
+typedef struct {
+    size_t cap; /* power of two */
+    _Atomic(dir_entry_t *) slot[]; /* NULL = empty, &dir_tomb = deleted */
+} dir_table_t;
+
+/* retired memory, freed once every worker has passed a quiescent state */
+typedef struct rcu_node {
+    struct rcu_node *next;
+    uint64_t epoch;
+    void *ptr;
+} rcu_node_t;
+
+static worker_t *workers = NULL;
+static int nworkers = 1;
+/* serializes joins, leaves and renames (directory writes, slab growth, live lists); never held across I/O */
 static pthread_mutex_t clients_mtx = PTHREAD_MUTEX_INITIALIZER;
 static int64_t next_id = 1;
-static int listen_fd = -1;
-static FILE *logf = NULL;
+static int max_clients = MAX_CLIENTS_DEFAULT;
 
-/* Timestamp helper */
-static void get_timestamp(char *buf, size_t n) {
-    time_t t = time(NULL);
-    struct tm tm;
-    localtime_r(&t, &tm);
-    strftime(buf, n, "%F %T", &tm);
+/* stopping: the supervisor (main thread) sets stop_mode; workers drain output until drain_deadline */
+enum { RUN, STOP_SHUTDOWN, STOP_HANDOFF };
+static atomic_int stop_mode = RUN;
+static _Atomic uint64_t drain_deadline;
+static int drain_ms = DRAIN_MS_DEFAULT;
+static atomic_int workers_running;
+static const char *handoff_path = NULL;  /* --handoff: unix socket a successor connects to */
+static const char *takeover_path = NULL; /* --takeover: predecessor's handoff socket */
+static int listen_port = PORT;
+static int listen_backlog = LISTEN_BACKLOG_DEFAULT;
+static int sock_sndbuf = 0, sock_rcvbuf = 0; /* --sndbuf/--rcvbuf, 0 = kernel autotuning */
+static int defer_accept = 0; /* --defer-accept seconds, 0 = off */
+static const char *tls_cert = NULL, *tls_key = NULL; /* --tls-cert/--tls-key */
+static SSL_CTX *tls_ctx = NULL; /* set when clients must speak TLS */
+static uint64_t idle_ticks = 0; /* --idle-timeout in ticks, 0 = off */
+static uint64_t ping_ticks = 0; /* --ping in ticks, 0 = off */
+static uint64_t tls_ticks = TLS_TIMEOUT_DEFAULT * 1000 / TICK_MS; /* --tls-timeout: time allowed for a handshake */
+static int metrics_port = 0; /* 0 = no metrics listener */
+static uint64_t start_ns;
+static atomic_int nclients = 0; /* changed under clients_mtx, read by stats without it */
+static char room_names[MAX_ROOMS][NAME_LEN] = { "lobby" }; /* guarded by clients_mtx; ids are indices */
+static int nrooms = 1;
+static atomic_int room_refs[MAX_ROOMS]; /* members on every shard, plus lookups not yet seated */
+static atomic_uint room_gen[MAX_ROOMS]; /* bumped when an id is given to another name */
+static atomic_uint_fast64_t room_idle_since[MAX_ROOMS]; /* when room_refs last fell to 0 */
+static uint64_t room_quota[ROOM_QUOTA_SLOTS]; /* GCRA tat per address hash; guarded by clients_mtx */
+static room_hist_t room_hist[MAX_ROOMS];
+
+/* journal state; everything below the queue belongs to the journal thread */
+static const char *journal_dir = NULL;
+static size_t journal_seg = (size_t)JOURNAL_SEG_DEFAULT << 20;
+static pthread_mutex_t jq_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jq_cond = PTHREAD_COND_INITIALIZER;
+static jent_t jq[JOURNAL_QUEUE];
+static uint32_t jq_head, jq_count;
+static int jq_stop, journal_running;
+static pthread_t journal_thread;
+
+/* cluster state; peers[] is fixed before the workers start */
+static int node_id = -1; /* --node, -1 = standalone */
+static int cluster_port = 0;
+static struct in_addr cluster_bind = { INADDR_ANY }; /* --cluster-bind */
+static peer_t peers[MAX_NODES];
+static int npeers;
+static int cluster_wake_fd = -1;
+
+/* what --takeover received, consumed by worker_init and adopt_clients */
+static int inherited_listen[MAX_WORKERS];
+static int ninherited;
+static adopted_t *adopted;
+static uint32_t nadopted;
+static atomic_uint_fast64_t stat_link_out, stat_link_in, stat_link_drops;
+static int jseg_fd = -1;
+static unsigned jseg_index;
+static char *jseg_map;
+static size_t jseg_off;
+static atomic_uint_fast64_t stat_journal_recs, stat_journal_drops;
+static int history_len = HISTORY_DEFAULT; /* 0 = no history */
+static size_t zip_min = ZIP_MIN_DEFAULT; /* 0 = compression off */
+static atomic_int zip_clients; /* connected FRAME_F_DEFLATE clients; renderings skip deflate while 0 */
+static _Atomic(dir_table_t *) dir_tab = NULL;
+static size_t dir_used = 0, dir_live = 0; /* guarded by clients_mtx; dir_used counts live entries and tombstones */
+static dir_entry_t dir_tomb;
+
+/* quiescent-state reclamation */
+static atomic_uint_fast64_t rcu_epoch = 1;
+static rcu_node_t *rcu_retired = NULL; /* guarded by clients_mtx */
+static atomic_int rcu_pending = 0;
+
+/* Profiling build (make profile, -DCHAT_PROFILE): log2 histograms of clients_mtx wait and hold times
+ * and of the self time of each stage of the message path, plus syscall counts, kept per thread and
+ * summed by prof_dump() on SIGUSR1 and at exit. A stage's self time leaves out the stages it calls,
+ * so the stage totals add up; lock waits count towards the stage that waited. Without CHAT_PROFILE
+ * every hook expands to nothing. */
+#ifdef CHAT_PROFILE
+enum { PS_LOCK_WAIT, PS_LOCK_HOLD, PS_RECV, PS_PARSE, PS_FORMAT, PS_DEFLATE, PS_FANOUT, PS_MAIL, PS_SEND, PS_LOG, PS_COUNT };
+enum { PC_RECV, PC_SEND, PC_WAIT, PC_ACCEPT, PC_EVENTFD, PC_TIMERFD, PC_COUNT };
+#define PROF_BUCKETS 32 /* bucket b: times below 2^b ns */
+#define PROF_THREADS 256
+
+typedef struct {
+    atomic_uint_fast64_t hist[PS_COUNT][PROF_BUCKETS];
+    atomic_uint_fast64_t ns[PS_COUNT];
+    atomic_uint_fast64_t sys[PC_COUNT];
+    uint64_t inner;   /* time of finished spans since the thread started; only its thread touches it */
+    uint64_t hold_t0; /* when this thread took clients_mtx */
+} prof_t;
+
+typedef struct { uint64_t t, inner; } prof_span_t;
+
+/* allocated, not thread-local, so a worker's numbers outlive the worker for the dump at exit */
+static prof_t *prof_all[PROF_THREADS];
+static atomic_int prof_nthreads;
+static __thread prof_t *prof_me;
+
+static uint64_t now_ns(void);
+
+static prof_t *prof_self(void) {
+    if (!prof_me) {
+        int i = atomic_fetch_add(&prof_nthreads, 1);
+        if (!(prof_me = calloc(1, sizeof(*prof_me)))) { perror("calloc"); exit(1); }
+        if (i < PROF_THREADS) prof_all[i] = prof_me;
+    }
+    return prof_me;
+}
+
+static void prof_bump(atomic_uint_fast64_t *a, uint64_t v) {
+    atomic_store_explicit(a, atomic_load_explicit(a, memory_order_relaxed) + v, memory_order_relaxed);
+}
+
+static void prof_record(int stage, uint64_t ns) {
+    prof_t *p = prof_self();
+    int b = ns ? 64 - __builtin_clzll(ns) : 0;
+    prof_bump(&p->hist[stage][b < PROF_BUCKETS ? b : PROF_BUCKETS - 1], 1);
+    prof_bump(&p->ns[stage], ns);
 }
 
-/* Logger (varargs) */
+static prof_span_t prof_begin(void) {
+    return (prof_span_t){ now_ns(), prof_self()->inner };
+}
+
+static void prof_end(int stage, prof_span_t s) {
+    prof_t *p = prof_self();
+    uint64_t d = now_ns() - s.t;
+    prof_record(stage, d - (p->inner - s.inner));
+    p->inner = s.inner + d;
+}
+
+static void prof_locked(uint64_t t0) {
+    prof_t *p = prof_self();
+    p->hold_t0 = now_ns();
+    prof_record(PS_LOCK_WAIT, p->hold_t0 - t0);
+}
+
+#define PROF_BEGIN(s) prof_span_t s = prof_begin()
+#define PROF_END(stage, s) prof_end(stage, s)
+#define PROF_SYS(k) prof_bump(&prof_self()->sys[k], 1)
+#define PROF_CLOCK(t) uint64_t t = now_ns()
+#define PROF_LOCKED(t) prof_locked(t)
+#define PROF_UNLOCKING() prof_record(PS_LOCK_HOLD, now_ns() - prof_self()->hold_t0)
+#else
+#define PROF_BEGIN(s) ((void)0)
+#define PROF_END(stage, s) ((void)0)
+#define PROF_SYS(k) ((void)0)
+#define PROF_CLOCK(t) ((void)0)
+#define PROF_LOCKED(t) ((void)0)
+#define PROF_UNLOCKING() ((void)0)
+#endif
+
+/* async logger: lock-free MPSC ring drained by one writer thread */
+static int log_fd = -1;
+static log_rec_t log_ring[LOG_RING_SIZE];
+static atomic_int log_running;
+static atomic_size_t log_head;        /* next slot producers claim */
+static atomic_size_t log_tail;        /* next slot the writer reads; only the writer stores it */
+static atomic_int log_idle, log_stop; /* writer is (about to be) asleep / asked to exit */
+static int log_wake_fd = -1;
+static pthread_t log_thread;
+static int log_policy = LOG_FLUSH_INTERVAL;
+static long log_flush_arg = LOG_INTERVAL_DEFAULT; /* records for LOG_FLUSH_RECORDS, ms for LOG_FLUSH_INTERVAL */
+static atomic_uint_fast64_t stat_log_drops;
+
+/* slow-consumer limits */
+static size_t out_high = OUT_HIGH_DEFAULT;
+static size_t out_low = 0; /* 0 = out_high / 2 */
+static int slow_policy = SLOW_DISCONNECT;
+static atomic_uint_fast64_t stat_drop_msgs, stat_drop_bytes, stat_evictions;
+
+/* input rate limits, per second; 0 = unlimited. Each bucket holds one second's worth. */
+static uint64_t rate_msgs = 0, rate_bytes = 0, rate_global = 0;
+static _Atomic uint64_t global_tat;
+static atomic_uint_fast64_t stat_rate_drops;
+
+/* Logger (varargs): claim a ring slot, format into it, publish. Never blocks; a full ring drops the record. */
 static void log_event(const char *fmt, ...) {
-    if (!logf) return;
-    char ts[32];
-    get_timestamp(ts, sizeof(ts));
-    fprintf(logf, "%s  ", ts);
+    if (!log_running) return;
+    PROF_BEGIN(span);
+    size_t pos = atomic_load_explicit(&log_head, memory_order_relaxed);
+    log_rec_t *r;
+    for (;;) {
+        r = &log_ring[pos & (LOG_RING_SIZE - 1)];
+        size_t seq = atomic_load_explicit(&r->seq, memory_order_acquire);
+        intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+        if (dif == 0) {
+            if (atomic_compare_exchange_weak_explicit(&log_head, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) break;
+        } else if (dif < 0) {
+            atomic_fetch_add_explicit(&stat_log_drops, 1, memory_order_relaxed);
+            PROF_END(PS_LOG, span);
+            return;
+        } else {
+            pos = atomic_load_explicit(&log_head, memory_order_relaxed);
+        }
+    }
+
+    r->ts = time(NULL);
     va_list ap;
     va_start(ap, fmt);
-    vfprintf(logf, fmt, ap);
+    int n = vsnprintf(r->text, sizeof(r->text), fmt, ap);
     va_end(ap);
-    fprintf(logf, "\n");
-    fflush(logf);
+    r->len = n < 0 ? 0 : (size_t)n < sizeof(r->text) ? (size_t)n : sizeof(r->text) - 1;
+    atomic_store_explicit(&r->seq, pos + 1, memory_order_release);
+
+    /* only the first record after the writer went idle pays for a wakeup */
+    if (atomic_exchange_explicit(&log_idle, 0, memory_order_acq_rel)) {
+        uint64_t one = 1;
+        PROF_SYS(PC_EVENTFD);
+        if (write(log_wake_fd, &one, sizeof(one)) < 0) { /* writer polls on its interval anyway */ }
+    }
+    PROF_END(PS_LOG, span);
+}
+
+static void log_write_out(const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(log_fd, buf, len);
+        if (n < 0) { if (errno == EINTR) continue; perror("log write"); return; }
+        buf += n;
+        len -= (size_t)n;
+    }
+}
+
+/* writer thread: drain the ring into one large buffer, write it per the flush policy */
+static void *log_writer(void *arg) {
+    (void)arg;
+    static char batch[LOG_BATCH_BYTES];
+    size_t blen = 0;
+    long pending = 0; /* records in batch */
+    time_t cached_sec = (time_t)-1;
+    char ts[32] = "";
+    struct timespec last_flush;
+    clock_gettime(CLOCK_MONOTONIC, &last_flush);
+
+    for (;;) {
+        int drained = 0;
+        for (;;) {
+            log_rec_t *r = &log_ring[log_tail & (LOG_RING_SIZE - 1)];
+            if (atomic_load_explicit(&r->seq, memory_order_acquire) != log_tail + 1) break;
+            if (r->ts != cached_sec) {
+                struct tm tm;
+                localtime_r(&r->ts, &tm);
+                strftime(ts, sizeof(ts), "%F %T", &tm);
+                cached_sec = r->ts;
+            }
+            size_t tl = strlen(ts);
+            if (blen + tl + 2 + r->len + 1 > sizeof(batch)) { log_write_out(batch, blen); blen = 0; pending = 0; }
+            memcpy(batch + blen, ts, tl); blen += tl;
+            memcpy(batch + blen, "  ", 2); blen += 2;
+            memcpy(batch + blen, r->text, r->len); blen += r->len;
+            batch[blen++] = '\n';
+            pending++;
+            atomic_store_explicit(&r->seq, log_tail + LOG_RING_SIZE, memory_order_release);
+            atomic_store_explicit(&log_tail, log_tail + 1, memory_order_relaxed);
+            drained = 1;
+        }
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long since_ms = (now.tv_sec - last_flush.tv_sec) * 1000 + (now.tv_nsec - last_flush.tv_nsec) / 1000000;
+        int stopping = atomic_load(&log_stop);
+        if (blen && ((log_policy == LOG_FLUSH_RECORDS && pending >= log_flush_arg) ||
+                     (log_policy == LOG_FLUSH_INTERVAL && since_ms >= log_flush_arg) || stopping)) {
+            log_write_out(batch, blen);
+            blen = 0;
+            pending = 0;
+            last_flush = now;
+        }
+        if (stopping && !drained) break;
+        if (drained) continue;
+
+        /* going idle: announce it, re-check so a record published meanwhile isn't missed, then sleep */
+        atomic_store(&log_idle, 1);
+        log_rec_t *r = &log_ring[log_tail & (LOG_RING_SIZE - 1)];
+        if (atomic_load_explicit(&r->seq, memory_order_acquire) == log_tail + 1) { atomic_store(&log_idle, 0); continue; }
+        struct pollfd p = { .fd = log_wake_fd, .events = POLLIN };
+        int timeout = log_policy == LOG_FLUSH_INTERVAL && blen ? (int)(log_flush_arg - since_ms) : -1;
+        if (poll(&p, 1, timeout < 0 ? -1 : timeout) > 0) {
+            uint64_t cnt;
+            if (read(log_wake_fd, &cnt, sizeof(cnt)) < 0) { /* spurious */ }
+        }
+        atomic_store(&log_idle, 0);
+    }
+    fsync(log_fd);
+    return NULL;
+}
+
+static void log_open(const char *path) {
+    log_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (log_fd < 0) { perror(path); return; }
+    log_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (log_wake_fd < 0) { perror("eventfd"); exit(1); }
+    for (size_t i = 0; i < LOG_RING_SIZE; ++i) atomic_init(&log_ring[i].seq, i);
+    if (pthread_create(&log_thread, NULL, log_writer, NULL) != 0) { perror("pthread_create"); exit(1); }
+    log_running = 1;
+}
+
+/* stop the writer after it drains everything already published; it fsyncs on the way out.
+   Late records from other threads land in the ring and are simply never written. */
+static void log_close(void) {
+    if (!log_running) return;
+    atomic_store(&log_stop, 1);
+    uint64_t one = 1;
+    if (write(log_wake_fd, &one, sizeof(one)) < 0) { /* writer will see log_stop on its next pass */ }
+    pthread_join(log_thread, NULL);
+    log_running = 0;
+    close(log_fd);
 }
 
-/* send all bytes */
+/* send all bytes; sockets are non-blocking, so wait (bounded) for POLLOUT on a full buffer */
 static int send_all(int fd, const char *buf, size_t len) {
     size_t sent = 0;
     while (sent < len) {
-        ssize_t n = send(fd, buf + sent, len - sent, 0);
+        ssize_t n = send(fd, buf + sent, len - sent, MSG_NOSIGNAL);
         if (n <= 0) {
             if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                struct pollfd p = { .fd = fd, .events = POLLOUT };
+                if (poll(&p, 1, SEND_TIMEOUT_MS) > 0) continue;
+            }
             return -1;
         }
         sent += (size_t)n;
@@ -77,226 +734,3306 @@ static void send_str(int fd, const char *s) {
     if (s) send_all(fd, s, strlen(s));
 }
 
-/* find free slot */
-static int find_free_slot(void) {
-    for (int i = 0; i < MAX_CLIENTS; ++i) if (!clients[i].alive) return i;
-    return -1;
+/* message buffers: formatted once, then shared by reference */
+static msgbuf_t *msg_new(const char *s, size_t len) {
+    msgbuf_t *m = malloc(sizeof(*m) + len + 1);
+    if (!m) { perror("malloc"); return NULL; }
+    atomic_init(&m->refs, 1);
+    m->bulk = 0;
+    m->len = len;
+    memcpy(m->data, s, len);
+    m->data[len] = '\0';
+    return m;
 }
 
-/* add client to slot, assign name Client-<id> */
-static int add_client(int fd) {
-    pthread_mutex_lock(&clients_mtx);
-    int slot = find_free_slot();
-    if (slot >= 0) {
-        clients[slot].fd = fd;
-        clients[slot].alive = 1;
-        clients[slot].id = next_id++;
-        /* safe formatting into fixed buffer */
-        snprintf(clients[slot].name, NAME_LEN, "Client-%" PRId64, clients[slot].id);
+static msgbuf_t *msg_fmt(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if (n < 0) return NULL;
+    msgbuf_t *m = malloc(sizeof(*m) + (size_t)n + 1);
+    if (!m) { perror("malloc"); return NULL; }
+    atomic_init(&m->refs, 1);
+    m->bulk = 0;
+    m->len = (size_t)n;
+    va_start(ap, fmt);
+    vsnprintf(m->data, (size_t)n + 1, fmt, ap);
+    va_end(ap);
+    return m;
+}
+
+static msgbuf_t *msg_ref(msgbuf_t *m) {
+    atomic_fetch_add_explicit(&m->refs, 1, memory_order_relaxed);
+    return m;
+}
+
+static void msg_unref(msgbuf_t *m) {
+    if (m && atomic_fetch_sub_explicit(&m->refs, 1, memory_order_acq_rel) == 1) free(m);
+}
+
+static inline client_t *client_at(worker_t *w, int slot) {
+    return &w->chunks[slot / CLIENT_CHUNK]->hot[slot % CLIENT_CHUNK];
+}
+
+static inline client_cold_t *cold_at(worker_t *w, int slot) {
+    return &w->chunks[slot / CLIENT_CHUNK]->cold[slot % CLIENT_CHUNK];
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/* single-writer counter bump: a relaxed load and store, no locked read-modify-write on the hot path */
+static inline void stat_add(worker_t *w, int idx, uint64_t v) {
+    atomic_store_explicit(&w->stats[idx], atomic_load_explicit(&w->stats[idx], memory_order_relaxed) + v, memory_order_relaxed);
+}
+
+/* take clients_mtx, and account the wait when it's contended; w is NULL off the worker threads */
+static void clients_lock(worker_t *w) {
+    PROF_CLOCK(t0);
+    if (pthread_mutex_trylock(&clients_mtx) != 0) {
+        uint64_t t = now_ns();
+        pthread_mutex_lock(&clients_mtx);
+        if (w) {
+            stat_add(w, ST_LOCK_WAITS, 1);
+            stat_add(w, ST_LOCK_WAIT_NS, now_ns() - t);
+        }
     }
+    PROF_LOCKED(t0);
+}
+
+/* for work that can wait for another turn: 0 when clients_mtx was free and is now held */
+static int clients_trylock(void) {
+    PROF_CLOCK(t0);
+    if (pthread_mutex_trylock(&clients_mtx) != 0) return -1;
+    PROF_LOCKED(t0);
+    return 0;
+}
+
+static void clients_unlock(void) {
+    PROF_UNLOCKING();
     pthread_mutex_unlock(&clients_mtx);
-    return slot;
 }
 
-/* remove client */
-static void remove_client(int slot) {
-    pthread_mutex_lock(&clients_mtx);
-    if (slot >= 0 && slot < MAX_CLIENTS && clients[slot].alive) {
-        close(clients[slot].fd);
-        clients[slot].alive = 0;
-        clients[slot].name[0] = '\0';
-        clients[slot].id = 0;
+static void fanout_done(worker_t *w, uint64_t start) {
+    uint64_t ns = now_ns() - start;
+    int b = ns < 256 ? 0 : 63 - __builtin_clzll(ns) - 7;
+    stat_add(w, ST_FANOUTS, 1);
+    stat_add(w, ST_FANOUT_NS, ns);
+    stat_add(w, ST_FANOUT_HIST + (b < FANOUT_BUCKETS ? b : FANOUT_BUCKETS - 1), 1);
+}
+
+static void count_drop(size_t bytes) {
+    atomic_fetch_add_explicit(&stat_drop_msgs, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stat_drop_bytes, bytes, memory_order_relaxed);
+}
+
+static void *pool_get(pool_t *p) {
+    if (p->n) return p->spare[--p->n];
+    void *b = malloc(p->size);
+    if (!b) perror("malloc");
+    return b;
+}
+
+static void pool_put(pool_t *p, void *b) {
+    if (!b) return;
+    if (p->n < POOL_SPARE) p->spare[p->n++] = b;
+    else free(b);
+}
+
+/* hand an empty output ring back; the next queued message borrows a fresh one */
+static void outq_release(worker_t *w, client_t *c) {
+    if (c->out_cap == OUTQ_MIN) pool_put(&w->outq_pool, c->outq);
+    else free(c->outq);
+    c->outq = NULL;
+    c->out_cap = c->out_head = c->out_count = 0;
+    c->out_prio = c->bulk_bytes = 0;
+}
+
+/* an input buffer with no partial line or frame left in it goes back to the pool */
+static void client_in_idle(worker_t *w, client_cold_t *cc) {
+    if (cc->in && !cc->in_len) { pool_put(&w->in_pool, cc->in); cc->in = NULL; }
+}
+
+static void mark_dirty(worker_t *w, int slot) {
+    client_t *c = client_at(w, slot);
+    if (!c->queued) { c->queued = 1; w->flush_list[w->nflush++] = slot; }
+}
+
+/* take the head of the output ring; the caller owns its reference */
+static msgbuf_t *outq_pop(client_t *c) {
+    msgbuf_t *m = c->outq[c->out_head];
+    c->out_head = (c->out_head + 1) & (c->out_cap - 1);
+    c->out_count--;
+    if (c->out_prio) c->out_prio--;
+    if (m->bulk) c->bulk_bytes -= (uint32_t)m->len;
+    return m;
+}
+
+/* SLOW_DROP_OLDEST: shed queued messages behind the partially sent head until back under the low mark.
+   Only the ones ahead of the chunks (out_prio), and never the newest of them: shedding a piece of a
+   transfer would tear it silently, so chunks are left to the bulk_bytes cut, which sends an abort. */
+static void drop_oldest(worker_t *w, client_t *c) {
+    uint32_t mask = c->out_cap - 1;
+    uint32_t keep = c->out_off ? 1 : 0;
+    while (c->out_bytes > out_low && keep + 1 < c->out_prio) {
+        uint32_t idx = (c->out_head + keep) & mask;
+        msgbuf_t *m = c->outq[idx];
+        if (m->bulk) break;
+        if (keep) c->outq[idx] = c->outq[c->out_head];
+        c->out_head = (c->out_head + 1) & mask;
+        c->out_count--;
+        if (keep < c->out_prio) c->out_prio--;
+        c->out_bytes -= m->len;
+        stat_add(w, ST_OUT_QUEUED, -(uint64_t)m->len);
+        count_drop(m->len);
+        msg_unref(m);
     }
-    pthread_mutex_unlock(&clients_mtx);
 }
 
-/* find client by id */
-static client_t *find_by_id(int64_t id) {
-    client_t *res = NULL;
-    pthread_mutex_lock(&clients_mtx);
-    for (int i = 0; i < MAX_CLIENTS; ++i) {
-        if (clients[i].alive && clients[i].id == id) { res = &clients[i]; break; }
+/* queue a message for a client (takes its own reference); nothing is written until flush_clients() or EPOLLOUT.
+   Chunks go to the back; anything else goes in front of chunks that haven't started to leave, so a
+   big transfer doesn't hold up chat on the same connection. */
+static void client_send(worker_t *w, int slot, msgbuf_t *m) {
+    client_t *c = client_at(w, slot);
+    if (!c->alive || c->evict || !m || m->len == 0) return;
+    if (c->out_bytes + m->len > out_high || c->dropping) {
+        if (slow_policy == SLOW_DISCONNECT) { c->evict = 1; mark_dirty(w, slot); return; }
+        if (slow_policy == SLOW_DROP_NEWEST) { c->dropping = 1; count_drop(m->len); return; }
     }
-    pthread_mutex_unlock(&clients_mtx);
-    return res;
+    if (!c->out_cap) {
+        if (!(c->outq = pool_get(&w->outq_pool))) return;
+        c->out_cap = OUTQ_MIN;
+        c->out_head = 0;
+    } else if (c->out_count == c->out_cap) {
+        uint32_t ncap = c->out_cap * 2;
+        msgbuf_t **nq = malloc(ncap * sizeof(*nq));
+        if (!nq) { perror("malloc"); return; }
+        for (uint32_t i = 0; i < c->out_count; ++i) nq[i] = c->outq[(c->out_head + i) & (c->out_cap - 1)];
+        if (c->out_cap == OUTQ_MIN) pool_put(&w->outq_pool, c->outq);
+        else free(c->outq);
+        c->outq = nq;
+        c->out_cap = ncap;
+        c->out_head = 0;
+    }
+    uint32_t mask = c->out_cap - 1, pos = c->out_count;
+    if (!m->bulk && c->out_prio < c->out_count) {
+        pos = c->out_prio ? c->out_prio : c->out_off ? 1 : 0; /* never ahead of a partly sent head */
+        for (uint32_t i = c->out_count; i > pos; --i) c->outq[(c->out_head + i) & mask] = c->outq[(c->out_head + i - 1) & mask];
+    }
+    c->outq[(c->out_head + pos) & mask] = msg_ref(m);
+    c->out_count++;
+    if (m->bulk) c->bulk_bytes += (uint32_t)m->len;
+    else c->out_prio = pos + 1;
+    c->out_bytes += m->len;
+    stat_add(w, ST_MSGS_OUT, 1);
+    stat_add(w, ST_OUT_QUEUED, m->len);
+    if (c->out_bytes > out_high) drop_oldest(w, c);
+    mark_dirty(w, slot);
+}
+
+static void put_be32(unsigned char *p, uint32_t v) { p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v; }
+static void put_be64(unsigned char *p, uint64_t v) { put_be32(p, (uint32_t)(v >> 32)); put_be32(p + 4, (uint32_t)v); }
+static uint32_t get_be32(const unsigned char *p) { return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3]; }
+static uint64_t get_be64(const unsigned char *p) { return (uint64_t)get_be32(p) << 32 | get_be32(p + 4); }
+
+/* binary frame; a non-NULL name is prefixed to the payload as [u8 len][name] */
+static msgbuf_t *frame_new(int type, int64_t id, const char *name, const char *body, size_t blen) {
+    size_t nl = name ? strlen(name) : 0;
+    size_t plen = (name ? 1 + nl : 0) + blen;
+    msgbuf_t *m = malloc(sizeof(*m) + FRAME_HDR + plen + 1);
+    if (!m) { perror("malloc"); return NULL; }
+    atomic_init(&m->refs, 1);
+    m->bulk = 0;
+    m->len = FRAME_HDR + plen;
+    unsigned char *p = (unsigned char *)m->data;
+    memset(p, 0, FRAME_HDR);
+    p[0] = (unsigned char)type;
+    put_be32(p + 4, (uint32_t)plen);
+    put_be64(p + 8, (uint64_t)id);
+    p += FRAME_HDR;
+    if (name) { *p++ = (unsigned char)nl; memcpy(p, name, nl); p += nl; }
+    memcpy(p, body, blen);
+    p[blen] = '\0';
+    return m;
+}
+
+static void out_release(outmsg_t *o) {
+    msg_unref(o->text);
+    msg_unref(o->bin);
+    msg_unref(o->zbin);
+    o->text = o->bin = o->zbin = NULL;
 }
 
-/* broadcast to all except except_fd (-1 = none) */
-static void broadcast_except(const char *msg, int except_fd) {
-    pthread_mutex_lock(&clients_mtx);
-    for (int i = 0; i < MAX_CLIENTS; ++i) {
-        if (clients[i].alive && clients[i].fd != except_fd) send_str(clients[i].fd, msg);
+/* A z_stream can't be shared, so each thread rendering broadcasts keeps one and resets it per
+   message; the output is what's shared. */
+static __thread z_stream zs;
+static __thread int zs_ready;
+
+static void zip_thread_end(void) {
+    if (zs_ready) deflateEnd(&zs);
+    zs_ready = 0;
+}
+
+/* the frame with its payload deflated, or NULL if that isn't smaller */
+static msgbuf_t *frame_deflate(const msgbuf_t *f) {
+    size_t plen = f->len - FRAME_HDR;
+    if (!zs_ready) {
+        if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -ZIP_WBITS, 5, Z_DEFAULT_STRATEGY) != Z_OK) return NULL;
+        zs_ready = 1;
+    } else if (deflateReset(&zs) != Z_OK) {
+        return NULL;
     }
-    pthread_mutex_unlock(&clients_mtx);
+    /* without the dictionary no client could inflate it: NULL sends the frame as it is */
+    if (deflateSetDictionary(&zs, (const Bytef *)ZIP_DICT, sizeof(ZIP_DICT) - 1) != Z_OK) return NULL;
+    msgbuf_t *m = malloc(sizeof(*m) + f->len);
+    if (!m) return NULL;
+    zs.next_in = (Bytef *)(f->data + FRAME_HDR);
+    zs.avail_in = (uInt)plen;
+    zs.next_out = (Bytef *)(m->data + FRAME_HDR);
+    zs.avail_out = (uInt)plen - 1; /* no room to break even: deflate stops short of Z_STREAM_END */
+    if (deflate(&zs, Z_FINISH) != Z_STREAM_END) { free(m); return NULL; }
+    size_t zlen = plen - 1 - zs.avail_out;
+    atomic_init(&m->refs, 1);
+    m->bulk = 0;
+    m->len = FRAME_HDR + zlen;
+    memcpy(m->data, f->data, FRAME_HDR);
+    unsigned char *h = (unsigned char *)m->data;
+    h[1] |= FRAME_F_DEFLATE;
+    h[2] = (unsigned char)(plen >> 8);
+    h[3] = (unsigned char)plen;
+    put_be32(h + 4, (uint32_t)zlen);
+    return m;
 }
 
-/* list users to a fd */
-static void list_users(int fd) {
-    char out[4096];
-    size_t pos = 0;
-    pos += snprintf(out + pos, sizeof(out) - pos, "=== Connected Users ===\n");
-    pthread_mutex_lock(&clients_mtx);
-    for (int i = 0; i < MAX_CLIENTS && pos + 64 < sizeof(out); ++i) {
-        if (clients[i].alive) pos += snprintf(out + pos, sizeof(out) - pos, "ID:%" PRId64 "  %s\n", clients[i].id, clients[i].name);
+/* server notice for everyone: text line as given, FRAME_SERVER without the newline */
+static outmsg_t notice_fmt(const char *fmt, ...) {
+    outmsg_t o = { NULL, NULL, NULL };
+    char buf[BUF_SIZE + 256];
+    PROF_BEGIN(span);
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    if (n < 0) return o;
+    size_t len = (size_t)n < sizeof(buf) ? (size_t)n : sizeof(buf) - 1;
+    o.text = msg_new(buf, len);
+    o.bin = frame_new(FRAME_SERVER, 0, NULL, buf, len && buf[len - 1] == '\n' ? len - 1 : len);
+    PROF_END(PS_FORMAT, span);
+    return o;
+}
+
+/* chat line (FRAME_MSG) or private message (FRAME_PM), both renderings, behind an already rendered
+   text prefix. Binary senders may embed newlines; text recipients see them as spaces so framing survives. */
+static outmsg_t chat_render(int type, int64_t from_id, const char *from_name, const char *prefix, size_t hl,
+                            const char *body, size_t blen) {
+    outmsg_t o = { NULL, NULL, NULL };
+    PROF_BEGIN(span);
+    msgbuf_t *t = malloc(sizeof(*t) + hl + blen + 2);
+    if (!t) { perror("malloc"); return o; }
+    atomic_init(&t->refs, 1);
+    t->bulk = 0;
+    memcpy(t->data, prefix, hl);
+    memcpy(t->data + hl, body, blen);
+    for (char *p = t->data + hl, *e = p + blen; p < e; ++p) if (*p == '\n' || *p == '\r' || *p == '\0') *p = ' ';
+    t->data[hl + blen] = '\n';
+    t->data[hl + blen + 1] = '\0';
+    t->len = hl + blen + 1;
+    o.text = t;
+    o.bin = frame_new(type, from_id, from_name, body, blen);
+    /* once per broadcast, however many recipients take it */
+    if (o.bin && type == FRAME_MSG && zip_min && blen >= zip_min && atomic_load_explicit(&zip_clients, memory_order_relaxed)) {
+        PROF_BEGIN(zspan);
+        o.zbin = frame_deflate(o.bin);
+        PROF_END(PS_DEFLATE, zspan);
     }
-    pthread_mutex_unlock(&clients_mtx);
-    pos += snprintf(out + pos, sizeof(out) - pos, "=======================\n");
-    send_all(fd, out, strlen(out));
+    PROF_END(PS_FORMAT, span);
+    return o;
 }
 
-/* client thread: arg is pointer to slot (malloc'd) */
-static void *client_thread(void *arg) {
-    int slot = *(int *)arg;
-    free(arg);
+static int chat_prefix(char *buf, size_t cap, int type, int64_t from_id, const char *from_name) {
+    const char *fmt = type == FRAME_PM ? "[PM from %s (ID:%" PRId64 ")]: " : "%s (ID:%" PRId64 "): ";
+    int n = snprintf(buf, cap, fmt, from_name, from_id);
+    return n < 0 ? 0 : n < (int)cap ? n : (int)cap - 1;
+}
 
-    int fd;
-    int64_t my_id;
-    char my_name[NAME_LEN];
+/* a message from a sender that isn't a local client (journal reload, other nodes) */
+static outmsg_t chat_out(int type, int64_t from_id, const char *from_name, const char *body, size_t blen) {
+    char prefix[sizeof(((sender_hdr_t *)0)->pm)];
+    int hl = chat_prefix(prefix, sizeof(prefix), type, from_id, from_name);
+    return chat_render(type, from_id, from_name, prefix, (size_t)hl, body, blen);
+}
 
-    pthread_mutex_lock(&clients_mtx);
-    fd = clients[slot].fd;
-    my_id = clients[slot].id;
-    snprintf(my_name, NAME_LEN, "%s", clients[slot].name);
-    pthread_mutex_unlock(&clients_mtx);
+/* a message from a local client, behind its cached prefix */
+static outmsg_t client_chat_out(int64_t id, client_cold_t *cc, int type, const char *body, size_t blen) {
+    if (!cc->hdr) {
+        if (!(cc->hdr = malloc(sizeof(*cc->hdr)))) { perror("malloc"); return (outmsg_t){ NULL, NULL, NULL }; }
+        cc->hdr->chat_len = (uint8_t)chat_prefix(cc->hdr->chat, sizeof(cc->hdr->chat), FRAME_MSG, id, cc->name);
+        cc->hdr->pm_len = (uint8_t)chat_prefix(cc->hdr->pm, sizeof(cc->hdr->pm), FRAME_PM, id, cc->name);
+    }
+    return type == FRAME_PM ? chat_render(type, id, cc->name, cc->hdr->pm, cc->hdr->pm_len, body, blen)
+                            : chat_render(type, id, cc->name, cc->hdr->chat, cc->hdr->chat_len, body, blen);
+}
 
-    char buf[BUF_SIZE];
+/* turn a FRAME_CHUNK rendering into one piece of a transfer: stream and flags into the frame header,
+   both renderings marked as bulk output. A piece with no data (the end of a line that filled the buffer
+   exactly) is only an end marker, so text clients get nothing for it. */
+static void chunk_mark(outmsg_t *o, int flags, unsigned stream) {
+    if (!o->text || !o->bin) return;
+    unsigned char *h = (unsigned char *)o->bin->data;
+    uint32_t plen = get_be32(h + 4);
+    if (o->text->len && (plen == 0 || plen == 1u + h[FRAME_HDR])) {
+        msg_unref(o->text);
+        if (!(o->text = msg_new("", 0))) { out_release(o); return; }
+    }
+    h[1] = (unsigned char)flags;
+    h[2] = (unsigned char)(stream >> 8);
+    h[3] = (unsigned char)stream;
+    o->text->bulk = o->bin->bulk = 1;
+}
 
-    /* welcome */
-    snprintf(buf, sizeof(buf), "Welcome %s (ID:%" PRId64 ")\nCommands: /name <new>, /list, /msg <id> <text>, /quit\n", my_name, my_id);
-    send_str(fd, buf);
+/* the empty FRAME_F_ABORT chunk that ends a transfer early; text clients get nothing */
+static outmsg_t chunk_abort(int64_t from_id, unsigned stream) {
+    outmsg_t o = { msg_new("", 0), frame_new(FRAME_CHUNK, from_id, NULL, "", 0), NULL };
+    chunk_mark(&o, FRAME_F_ABORT, stream);
+    return o;
+}
 
-    /* announce */
-    snprintf(buf, sizeof(buf), "[Server] %s (ID:%" PRId64 ") joined.\n", my_name, my_id);
-    broadcast_except(buf, fd);
-    log_event("CONNECT id=%" PRId64 " name=%s", my_id, my_name);
+/* a chunk over the client's budget is dropped, and so is the rest of its transfer: the first drop
+   queues an abort behind the chunks already waiting. A cut is forgotten at the transfer's last piece or
+   at an abort from the sender's side (it left, or was rate limited). 1 when the client doesn't get this one. */
+static int chunk_refused(worker_t *w, int slot, const outmsg_t *o) {
+    client_t *c = client_at(w, slot);
+    client_cold_t *cc = cold_at(w, slot);
+    const unsigned char *h = (const unsigned char *)o->bin->data;
+    const msgbuf_t *m = c->proto == PROTO_BINARY ? o->bin : o->text;
+    int64_t from = (int64_t)get_be64(h + 8);
+    int stream = h[2] << 8 | h[3], more = h[1] & FRAME_F_MORE, k = 0, free_k = -1;
+    for (; k < CHUNK_CUTS && !(cc->cut[k].stream == stream && cc->cut[k].from == from); ++k)
+        if (cc->cut[k].stream < 0) free_k = k;
+    if (h[1] & FRAME_F_ABORT) {
+        if (k < CHUNK_CUTS) { cc->cut[k].stream = -1; return 1; } /* already told */
+        return 0;
+    }
+    if (k < CHUNK_CUTS) {
+        if (!more) cc->cut[k].stream = -1;
+        count_drop(m->len);
+        return 1;
+    }
+    if (c->bulk_bytes + m->len <= (out_low < UINT32_MAX / 2 ? out_low : UINT32_MAX / 2)) return 0; /* bulk_bytes is 32-bit */
+    if (more) {
+        if (free_k < 0) return 0; /* can't remember another cut: better over budget than a torn transfer */
+        cc->cut[free_k].from = from;
+        cc->cut[free_k].stream = stream;
+    }
+    count_drop(m->len);
+    outmsg_t a = chunk_abort(from, (unsigned)stream);
+    client_send(w, slot, c->proto == PROTO_BINARY ? a.bin : a.text);
+    out_release(&a);
+    return 1;
+}
 
-    while (1) {
-        ssize_t n = recv(fd, buf, sizeof(buf) - 1, 0);
-        if (n <= 0) break;
-        buf[n] = '\0';
-        while (n > 0 && (buf[n-1] == '\n' || buf[n-1] == '\r')) buf[--n] = '\0';
-        if (n == 0) break;
-
-        if (buf[0] == '/') {
-            if (strncmp(buf, "/quit", 5) == 0) break;
-
-            if (strncmp(buf, "/name ", 6) == 0) {
-                char *newn = buf + 6;
-                if (*newn == '\0') { send_str(fd, "Usage: /name <newname>\n"); continue; }
-
-                /* safe bounded copy for name to avoid truncation warnings */
-                size_t nl = strnlen(newn, NAME_LEN - 1);
-                pthread_mutex_lock(&clients_mtx);
-                memcpy(clients[slot].name, newn, nl);
-                clients[slot].name[nl] = '\0';
-                memcpy(my_name, clients[slot].name, nl + 1);
-                pthread_mutex_unlock(&clients_mtx);
-
-                snprintf(buf, sizeof(buf), "[Server] ID %" PRId64 " is now known as %s\n", my_id, my_name);
-                broadcast_except(buf, -1);
-                log_event("RENAME id=%" PRId64 " name=%s", my_id, my_name);
-                continue;
-            }
+/* queue whichever rendering matches the client's protocol */
+static void client_send_out(worker_t *w, int slot, const outmsg_t *o) {
+    client_t *c = client_at(w, slot);
+    if (o->bin && o->bin->bulk && chunk_refused(w, slot, o)) return;
+    if (c->deflate && o->zbin) {
+        stat_add(w, ST_ZIP_OUT, 1);
+        stat_add(w, ST_ZIP_SAVED, o->bin->len - o->zbin->len);
+        client_send(w, slot, o->zbin);
+        return;
+    }
+    client_send(w, slot, c->proto == PROTO_BINARY ? o->bin : o->text);
+}
 
-            if (strncmp(buf, "/list", 5) == 0) { list_users(fd); continue; }
-
-            if (strncmp(buf, "/msg ", 5) == 0) {
-                char *p = buf + 5;
-                int64_t tid = atoll(p);
-                while (*p && *p != ' ') p++;
-                if (*p == ' ') p++;
-                client_t *tgt = find_by_id(tid);
-                if (tgt) {
-                    char pm[BUF_SIZE + 64];
-                    snprintf(pm, sizeof(pm), "[PM from %s (ID:%" PRId64 ")]: %s\n", my_name, my_id, p);
-                    send_str(tgt->fd, pm);
-                    send_str(fd, "[PM sent]\n");
-                    log_event("PM from=%" PRId64 " to=%" PRId64 " text=%s", my_id, tgt->id, p);
-                } else { send_str(fd, "User not found.\n"); }
-                continue;
-            }
+/* a notice rendered in the client's own protocol only */
+static msgbuf_t *notice_for(const client_t *c, const char *s) {
+    size_t len = strlen(s);
+    return c->proto == PROTO_BINARY ? frame_new(FRAME_SERVER, 0, NULL, s, len && s[len - 1] == '\n' ? len - 1 : len)
+                                    : msg_new(s, len);
+}
 
-            send_str(fd, "Unknown command.\n");
-            continue;
+/* one-off notice to a single client */
+static void client_notice(worker_t *w, int slot, const char *s) {
+    msgbuf_t *m = notice_for(client_at(w, slot), s);
+    client_send(w, slot, m);
+    msg_unref(m);
+}
+
+/* write queued output until done or EAGAIN (EPOLLOUT resumes); -1 on socket error.
+   Pending messages go out as one gathered sendmsg per IOV_BATCH, not one send each. */
+static int client_flush(worker_t *w, client_t *c) {
+    if (c->handshake) return 0; /* queued until the kernel holds the keys */
+    while (c->out_count) {
+        struct iovec iov[IOV_BATCH];
+        int niov = 0;
+        size_t total = 0;
+        for (uint32_t i = 0; i < c->out_count && niov < IOV_BATCH; ++i) {
+            msgbuf_t *m = c->outq[(c->out_head + i) & (c->out_cap - 1)];
+            size_t off = i == 0 ? c->out_off : 0;
+            iov[niov].iov_base = m->data + off;
+            iov[niov].iov_len = m->len - off;
+            total += iov[niov].iov_len;
+            niov++;
+        }
+        struct msghdr mh = { .msg_iov = iov, .msg_iovlen = (size_t)niov };
+        PROF_BEGIN(span);
+        ssize_t n = sendmsg(c->fd, &mh, MSG_NOSIGNAL);
+        PROF_END(PS_SEND, span);
+        PROF_SYS(PC_SEND);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
         }
 
-        /* normal message -> broadcast */
-        char out[BUF_SIZE + 64];
-        snprintf(out, sizeof(out), "%s (ID:%" PRId64 "): %s\n", my_name, my_id, buf);
-        broadcast_except(out, fd);
-        log_event("MSG id=%" PRId64 " name=%s text=%s", my_id, my_name, buf);
+        /* release fully written messages, remember how far into the next one we got */
+        size_t left = (size_t)n;
+        c->out_bytes -= (size_t)n;
+        stat_add(w, ST_BYTES_OUT, (uint64_t)n);
+        stat_add(w, ST_OUT_QUEUED, -(uint64_t)n);
+        while (c->out_count) {
+            msgbuf_t *m = c->outq[c->out_head];
+            size_t rem = m->len - c->out_off;
+            if (left < rem) { c->out_off += left; break; }
+            left -= rem;
+            msg_unref(outq_pop(c));
+            c->out_off = 0;
+        }
+        if (c->dropping && c->out_bytes <= out_low) c->dropping = 0;
+        if ((size_t)n < total) return 0; /* short write: socket buffer is full, wait for EPOLLOUT */
     }
+    if (c->outq) outq_release(w, c);
+    c->dropping = 0;
+    return 0;
+}
 
-    /* disconnect */
-    snprintf(buf, sizeof(buf), "[Server] %s (ID:%" PRId64 ") disconnected.\n", my_name, my_id);
-    broadcast_except(buf, fd);
-    log_event("DISCONNECT id=%" PRId64 " name=%s", my_id, my_name);
-    remove_client(slot);
-    return NULL;
+/* a notice the client must see before it is closed: closing discards whatever is still queued, so
+   write it now. With an io_uring send in flight the queue can't be written here; the notice then goes
+   straight to the socket, best effort, as an eviction's does. */
+static void client_notice_flush(worker_t *w, int slot, const char *s) {
+    client_t *c = client_at(w, slot);
+    if (!c->tx_busy) { client_notice(w, slot, s); client_flush(w, c); return; }
+    msgbuf_t *m = notice_for(c, s);
+    if (m && !c->handshake && send(c->fd, m->data, m->len, MSG_NOSIGNAL | MSG_DONTWAIT) < 0) { /* best effort */ }
+    msg_unref(m);
+}
+
+/* drop anything still queued */
+static void client_discard_output(worker_t *w, client_t *c) {
+    stat_add(w, ST_OUT_QUEUED, -(uint64_t)c->out_bytes);
+    for (uint32_t i = 0; i < c->out_count; ++i) msg_unref(c->outq[(c->out_head + i) & (c->out_cap - 1)]);
+    if (c->outq) outq_release(w, c);
+    c->out_off = 0;
+    c->out_bytes = 0;
+    c->dropping = 0;
+    c->evict = 0;
+}
+
+/* queue mail on another worker and wake it; the mail holds a reference, not a copy */
+static void post_mail(worker_t *w, int kind, int slot, int64_t id, int except_fd, const outmsg_t *msg) {
+    mail_t *m = malloc(sizeof(*m));
+    if (!m) { perror("malloc"); return; }
+    m->next = NULL;
+    m->kind = kind;
+    m->slot = slot;
+    m->id = id;
+    m->except_fd = except_fd;
+    m->msg.text = msg->text ? msg_ref(msg->text) : NULL;
+    m->msg.bin = msg->bin ? msg_ref(msg->bin) : NULL;
+    m->msg.zbin = msg->zbin ? msg_ref(msg->zbin) : NULL;
+
+    pthread_mutex_lock(&w->inbox_mtx);
+    int was_empty = w->inbox_head == NULL;
+    if (w->inbox_tail) w->inbox_tail->next = m; else w->inbox_head = m;
+    w->inbox_tail = m;
+    pthread_mutex_unlock(&w->inbox_mtx);
+
+    /* the first mail of a batch wakes the loop; later ones ride along */
+    if (was_empty) {
+        uint64_t one = 1;
+        PROF_SYS(PC_EVENTFD);
+        if (write(w->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) perror("eventfd write");
+    }
+}
+
+/* id hash: ids are sequential, Fibonacci hashing spreads them over the table */
+static size_t dir_hash(int64_t id, size_t cap) {
+    return (size_t)(((uint64_t)id * 0x9E3779B97F4A7C15ull) >> 32) & (cap - 1);
+}
+
+/* a worker holds no directory pointers between event batches; announcing that lets writers reclaim */
+static void rcu_quiescent(worker_t *w) {
+    atomic_store(&w->rcu_seen, atomic_load(&rcu_epoch));
+}
+
+/* parked in epoll_wait: extended quiescent state, writers needn't wait for this worker */
+static void rcu_offline(worker_t *w) {
+    atomic_store(&w->rcu_seen, 0);
 }
 
-/* shutdown */
-static void shutdown_server(void) {
-    if (listen_fd != -1) close(listen_fd);
-    pthread_mutex_lock(&clients_mtx);
-    for (int i = 0; i < MAX_CLIENTS; ++i) {
-        if (clients[i].alive) {
-            send_str(clients[i].fd, "[Server] Shutting down.\n");
-            close(clients[i].fd);
-            clients[i].alive = 0;
+/* free whatever every online worker has moved past; clients_mtx held */
+static void rcu_reclaim(void) {
+    uint64_t min = UINT64_MAX;
+    for (int i = 0; i < nworkers; ++i) {
+        uint64_t seen = atomic_load(&workers[i].rcu_seen);
+        if (seen && seen < min) min = seen;
+    }
+    rcu_node_t **pp = &rcu_retired;
+    while (*pp) {
+        rcu_node_t *n = *pp;
+        if (n->epoch < min) {
+            *pp = n->next;
+            free(n->ptr);
+            free(n);
+            atomic_fetch_sub(&rcu_pending, 1);
+        } else {
+            pp = &n->next;
         }
     }
-    pthread_mutex_unlock(&clients_mtx);
-    if (logf) { log_event("SERVER SHUTDOWN"); fclose(logf); }
 }
 
-static void sig_handler(int s) { (void)s; shutdown_server(); exit(0); }
+/* hand memory unlinked from the directory to the reclaimer; clients_mtx held */
+static void rcu_retire(void *ptr) {
+    rcu_node_t *n = malloc(sizeof(*n));
+    if (!n) { perror("malloc"); return; } /* leak rather than free under a reader */
+    n->ptr = ptr;
+    n->epoch = atomic_fetch_add(&rcu_epoch, 1);
+    n->next = rcu_retired;
+    rcu_retired = n;
+    atomic_fetch_add(&rcu_pending, 1);
+}
 
-/* main */
-int main(void) {
-    memset(clients, 0, sizeof(clients));
-    logf = fopen("server.log", "a");
+/* lock-free: valid until the caller's next quiescent state */
+static const dir_entry_t *dir_find(int64_t id) {
+    dir_table_t *t = atomic_load(&dir_tab);
+    for (size_t i = dir_hash(id, t->cap);; i = (i + 1) & (t->cap - 1)) {
+        dir_entry_t *e = atomic_load(&t->slot[i]);
+        if (!e) return NULL;
+        if (e != &dir_tomb && e->id == id) return e;
+    }
+}
+
+/* writers below hold clients_mtx */
+static size_t dir_slot_of(dir_table_t *t, int64_t id) {
+    size_t i = dir_hash(id, t->cap);
+    for (dir_entry_t *e; (e = atomic_load(&t->slot[i])); i = (i + 1) & (t->cap - 1)) {
+        if (e != &dir_tomb && e->id == id) return i;
+    }
+    return SIZE_MAX;
+}
 
-    signal(SIGINT, sig_handler);
-    signal(SIGTERM, sig_handler);
+static dir_table_t *dir_alloc(size_t cap) {
+    dir_table_t *t = calloc(1, sizeof(*t) + cap * sizeof(t->slot[0]));
+    if (!t) { perror("calloc"); exit(1); }
+    t->cap = cap;
+    return t;
+}
 
-    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (listen_fd < 0) { perror("socket"); exit(1); }
+static void dir_place(dir_table_t *t, dir_entry_t *e) {
+    size_t i = dir_hash(e->id, t->cap);
+    dir_entry_t *cur;
+    while ((cur = atomic_load(&t->slot[i])) && cur != &dir_tomb) i = (i + 1) & (t->cap - 1);
+    if (!cur) dir_used++;
+    atomic_store(&t->slot[i], e);
+}
 
-    int opt = 1;
-    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+/* rebuild once the table is three quarters used: clears tombstones, doubles when half is live.
+   Entries move to the new table as they are; only the old slot array is retired. */
+static void dir_rehash(void) {
+    dir_table_t *old = atomic_load(&dir_tab);
+    dir_table_t *t = dir_alloc(dir_live * 2 >= old->cap ? old->cap * 2 : old->cap);
+    dir_used = 0;
+    for (size_t i = 0; i < old->cap; ++i) {
+        dir_entry_t *e = atomic_load(&old->slot[i]);
+        if (e && e != &dir_tomb) dir_place(t, e);
+    }
+    atomic_store(&dir_tab, t);
+    rcu_retire(old);
+}
 
-    struct sockaddr_in serv = {0};
-    serv.sin_family = AF_INET;
-    serv.sin_addr.s_addr = INADDR_ANY;
-    serv.sin_port = htons(PORT);
+static void dir_insert(int64_t id, int worker, int slot, const char *name) {
+    dir_entry_t *e = malloc(sizeof(*e));
+    if (!e) { perror("malloc"); exit(1); }
+    e->id = id;
+    e->worker = worker;
+    e->slot = slot;
+    snprintf(e->name, NAME_LEN, "%s", name);
+    if ((dir_used + 1) * 4 > atomic_load(&dir_tab)->cap * 3) dir_rehash();
+    dir_place(atomic_load(&dir_tab), e);
+    dir_live++;
+}
 
-    if (bind(listen_fd, (struct sockaddr *)&serv, sizeof(serv)) < 0) { perror("bind"); exit(1); }
-    if (listen(listen_fd, BACKLOG) < 0) { perror("listen"); exit(1); }
+/* copy-on-write: readers see the old name or the new one, never a torn mix */
+static void dir_rename(int64_t id, const char *name) {
+    dir_table_t *t = atomic_load(&dir_tab);
+    size_t i = dir_slot_of(t, id);
+    if (i == SIZE_MAX) return;
+    dir_entry_t *old = atomic_load(&t->slot[i]);
+    dir_entry_t *e = malloc(sizeof(*e));
+    if (!e) { perror("malloc"); return; }
+    *e = *old;
+    snprintf(e->name, NAME_LEN, "%s", name);
+    atomic_store(&t->slot[i], e);
+    rcu_retire(old);
+}
 
-    printf("Chat server running on port %d...\n", PORT);
+static void dir_remove(int64_t id) {
+    dir_table_t *t = atomic_load(&dir_tab);
+    size_t i = dir_slot_of(t, id);
+    if (i == SIZE_MAX) return;
+    dir_entry_t *old = atomic_load(&t->slot[i]);
+    atomic_store(&t->slot[i], &dir_tomb); /* unreachable before the epoch moves on */
+    rcu_retire(old);
+    dir_live--;
+}
 
-    while (1) {
-        struct sockaddr_in cli;
-        socklen_t len = sizeof(cli);
-        int client_fd = accept(listen_fd, (struct sockaddr *)&cli, &len);
-        if (client_fd < 0) {
-            if (errno == EINTR) break;
-            perror("accept");
-            continue;
-        }
+static void dir_init(size_t capacity) {
+    size_t cap = 16;
+    while (cap < capacity * 2) cap <<= 1;
+    atomic_store(&dir_tab, dir_alloc(cap));
+}
+
+/* add one slab chunk to a shard; called with clients_mtx held since other workers walk live lists under it */
+static int worker_grow(worker_t *w) {
+    int cap = (w->nchunks + 1) * CLIENT_CHUNK;
+    client_chunk_t **chunks = realloc(w->chunks, (size_t)(w->nchunks + 1) * sizeof(*chunks));
+    if (!chunks) return -1;
+    w->chunks = chunks;
+    int *live = realloc(w->live, (size_t)cap * sizeof(int));
+    if (live) w->live = live;
+    int *flush = realloc(w->flush_list, (size_t)cap * sizeof(int));
+    if (flush) w->flush_list = flush;
+    int *fr = realloc(w->free_slots, (size_t)cap * sizeof(int));
+    if (fr) w->free_slots = fr;
+    client_chunk_t *ch = live && flush && fr ? calloc(1, sizeof(*ch)) : NULL;
+    if (!ch) { perror("worker_grow"); return -1; }
+    w->chunks[w->nchunks++] = ch;
+    for (int i = cap - 1; i >= cap - CLIENT_CHUNK; --i) w->free_slots[w->nfree++] = i;
+    return 0;
+}
 
-        int slot = add_client(client_fd);
-        if (slot < 0) { send_str(client_fd, "Server full.\n"); close(client_fd); continue; }
+/* pop a free slot, growing the slab when the shard is full */
+static int find_free_slot(worker_t *w) {
+    if (w->nfree == 0 && worker_grow(w) < 0) return -1;
+    return w->free_slots[--w->nfree];
+}
+
+/* Hierarchical timer wheel: level L bucket i holds deadlines whose bits above L*WHEEL_BITS match i while
+   they are 64^L..64^(L+1) ticks away; they cascade a level down each time the level below wraps.
+   A client has at most one entry and is only re-armed when it fires, so input costs no wheel work. */
+static void wheel_add(worker_t *w, int slot, uint64_t at) {
+    client_cold_t *cc = cold_at(w, slot);
+    uint64_t max = (1ull << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+    if (at <= w->tick) at = w->tick + 1;
+    if (at - w->tick > max) at = w->tick + max;
+    int lvl = 0;
+    while (lvl < WHEEL_LEVELS - 1 && at - w->tick >= 1ull << (WHEEL_BITS * (lvl + 1))) lvl++;
+    int b = lvl * WHEEL_SIZE + (int)((at >> (WHEEL_BITS * lvl)) & (WHEEL_SIZE - 1));
+    cc->tbucket = b;
+    cc->tprev = -1;
+    cc->tnext = w->wheel[b];
+    if (cc->tnext >= 0) cold_at(w, cc->tnext)->tprev = slot;
+    w->wheel[b] = slot;
+}
 
-        int *arg = malloc(sizeof(int));
-        if (!arg) { perror("malloc"); remove_client(slot); continue; }
-        *arg = slot;
+static void wheel_del(worker_t *w, int slot) {
+    client_cold_t *cc = cold_at(w, slot);
+    if (cc->tbucket < 0) return;
+    if (cc->tprev >= 0) cold_at(w, cc->tprev)->tnext = cc->tnext;
+    else w->wheel[cc->tbucket] = cc->tnext;
+    if (cc->tnext >= 0) cold_at(w, cc->tnext)->tprev = cc->tprev;
+    cc->tbucket = -1;
+}
 
-        pthread_create(&clients[slot].thread, NULL, client_thread, arg);
-        pthread_detach(clients[slot].thread);
+/* when the client's next timeout decision is due */
+static uint64_t client_deadline(const client_t *c, const client_cold_t *cc, uint64_t now) {
+    if (c->handshake) return cc->last_rx + tls_ticks; /* the idle and ping clocks start once it is seated */
+    uint64_t at = UINT64_MAX;
+    if (idle_ticks) at = cc->last_rx + idle_ticks;
+    if (ping_ticks) {
+        uint64_t p = cc->last_rx + (now - cc->last_rx < ping_ticks ? ping_ticks : 2 * ping_ticks);
+        if (p < at) at = p;
     }
+    return at;
+}
 
-    shutdown_server();
-    return 0;
+/* list a client on its shard and in the directory, so /list, /msg and broadcasts reach it */
+static void client_seat(worker_t *w, int slot) {
+    clients_lock(w);
+    client_cold_t *cc = cold_at(w, slot);
+    cc->live_idx = w->nlive;
+    w->live[w->nlive++] = slot;
+    dir_insert(client_at(w, slot)->id, w->index, slot, cc->name);
+    clients_unlock();
+}
+
+/* add client to slot, assign name Client-<id>. id 0: a new connection, which gets the next id and
+   that default name; otherwise one adopted in a handoff, which keeps both. A TLS connection holds its
+   slot and id while it handshakes but is seated (client_seat) only once that is done. */
+static int add_client(worker_t *w, int fd, int64_t id, const char *name, int tls) {
+    clients_lock(w);
+    int slot = nclients < max_clients ? find_free_slot(w) : -1;
+    if (slot >= 0) {
+        client_t *c = client_at(w, slot);
+        client_cold_t *cc = cold_at(w, slot);
+        c->fd = fd;
+        c->alive = 1;
+        c->id = id ? id : node_id >= 0 ? next_id++ << NODE_BITS | node_id : next_id++;
+        /* safe formatting into fixed buffer */
+        if (name) snprintf(cc->name, NAME_LEN, "%s", name);
+        else snprintf(cc->name, NAME_LEN, "Client-%" PRId64, c->id);
+        cc->room = -1;
+        cc->live_idx = -1;
+        c->handshake = (uint8_t)tls;
+        cc->last_rx = w->tick;
+        cc->tat_msgs = cc->tat_bytes = 0;
+        cc->limited = 0;
+        cc->streaming = cc->greeted = 0;
+        cc->nxfer = 0;
+        for (int i = 0; i < CHUNK_CUTS; ++i) cc->cut[i].stream = -1;
+        cc->tbucket = -1;
+        if (w->timer_fd >= 0) wheel_add(w, slot, client_deadline(c, cc, w->tick));
+        nclients++;
+    }
+    clients_unlock();
+    if (slot >= 0 && !tls) client_seat(w, slot);
+    return slot;
+}
+
+static void room_exit(worker_t *w, int slot);
+
+/* remove client */
+static void remove_client(worker_t *w, int slot) {
+    clients_lock(w);
+    client_t *c = client_at(w, slot);
+    client_cold_t *cc = cold_at(w, slot);
+    if (c->alive) {
+        if (w->ring) shutdown(c->fd, SHUT_RDWR); /* ends the multishot recv, which holds the file open */
+        close(c->fd);
+        client_discard_output(w, c);
+        if (!c->tx_busy) pool_put(&w->tx_pool, cc->tx); /* a busy one is returned by its completion */
+        cc->tx = NULL;
+        c->tx_busy = 0;
+        pool_put(&w->in_pool, cc->in);
+        cc->in = NULL;
+        cc->in_len = 0;
+        SSL_free(cc->tls);
+        cc->tls = NULL;
+        c->handshake = 0;
+        if (c->deflate) atomic_fetch_sub(&zip_clients, 1);
+        c->deflate = 0;
+        wheel_del(w, slot);
+        c->alive = 0;
+        c->proto = PROTO_UNKNOWN;
+        cc->name[0] = '\0';
+        free(cc->hdr);
+        cc->hdr = NULL;
+        room_exit(w, slot);
+        if (cc->live_idx >= 0) {
+            dir_remove(c->id);
+            /* swap-remove from the live list */
+            int last = w->live[--w->nlive];
+            w->live[cc->live_idx] = last;
+            cold_at(w, last)->live_idx = cc->live_idx;
+            cc->live_idx = -1;
+        }
+        c->id = 0;
+        nclients--;
+        w->free_slots[w->nfree++] = slot;
+    }
+    clients_unlock();
+}
+
+/* find client by id (O(1), lock-free via the directory); reports owner and slot rather than a pointer
+   another worker may recycle, and send_to() re-checks the id on the owning shard */
+static int find_by_id(int64_t id, int *worker, int *slot) {
+    if (id <= 0) return 0;
+    const dir_entry_t *d = dir_find(id);
+    if (d) { *worker = d->worker; *slot = d->slot; }
+    return d != NULL;
+}
+
+/* the id that has gone longest with nobody in it or about to enter, its history dropped; the lobby is
+   never given up. Under clients_mtx, where refs can't rise from 0: only room_register pins a free id. */
+static int room_reclaim(void) {
+    int id = -1;
+    uint64_t oldest = UINT64_MAX;
+    for (int i = LOBBY + 1; i < MAX_ROOMS; ++i) {
+        uint64_t t = atomic_load(&room_idle_since[i]);
+        if (!atomic_load(&room_refs[i]) && t < oldest) { oldest = t; id = i; }
+    }
+    if (id < 0) return -1;
+    room_hist_t *h = &room_hist[id];
+    pthread_mutex_lock(&h->mtx);
+    for (uint32_t i = 0; i < h->count; ++i) out_release(&h->ring[(h->head + i) % (uint32_t)history_len]);
+    h->head = h->count = 0;
+    pthread_mutex_unlock(&h->mtx);
+    return id;
+}
+
+/* charge one room creation to the client's address: ROOMS_PER_ADDR at once, then one per
+   ROOM_CREATE_MS (GCRA, as the rate limits), so reconnecting doesn't buy more. -1 when over. */
+static int room_quota_take(worker_t *w, int fd) {
+    struct sockaddr_in sa;
+    socklen_t sl = sizeof(sa);
+    uint32_t a = getpeername(fd, (struct sockaddr *)&sa, &sl) == 0 && sa.sin_family == AF_INET ? sa.sin_addr.s_addr : 0;
+    uint64_t period = ROOM_CREATE_MS * 1000000ull, now = now_ns();
+    uint64_t *tat = &room_quota[dir_hash(a, ROOM_QUOTA_SLOTS)];
+    clients_lock(w);
+    uint64_t t = *tat > now ? *tat : now;
+    int ok = t + period <= now + ROOMS_PER_ADDR * period;
+    if (ok) *tat = t + period;
+    clients_unlock();
+    return ok ? 0 : -1;
+}
+
+/* look a room up by name under clients_mtx, registering it on first use when create is set. The id
+   comes back pinned (room_unpin once seated or done with it) so it can't be reclaimed in between;
+   -1 when absent and not to be created, or when the registry is full */
+static int room_register(const char *name, int create) {
+    int id = 0;
+    while (id < nrooms && strcmp(room_names[id], name) != 0) id++;
+    if (id == nrooms) {
+        if (!create) return -1;
+        if (nrooms < MAX_ROOMS) nrooms++;
+        else if ((id = room_reclaim()) < 0) return -1;
+        else atomic_fetch_add(&room_gen[id], 1);
+        snprintf(room_names[id], NAME_LEN, "%s", name);
+    }
+    atomic_fetch_add(&room_refs[id], 1);
+    return id;
+}
+
+static int room_lookup(worker_t *w, const char *name, int create) {
+    clients_lock(w);
+    int id = room_register(name, create);
+    clients_unlock();
+    return id;
+}
+
+/* take or drop a reference; pinning without clients_mtx needs one already held (a member's own room) */
+static void room_pin(int room) { atomic_fetch_add(&room_refs[room], 1); }
+static void room_unpin(int room) {
+    if (atomic_fetch_sub(&room_refs[room], 1) == 1) atomic_store(&room_idle_since[room], now_ns());
+}
+
+/* seat a client in a room on its own shard */
+static int room_enter(worker_t *w, int slot, int room) {
+    if (room >= w->rooms_cap) {
+        int cap = w->rooms_cap ? w->rooms_cap : 8;
+        while (cap <= room) cap *= 2;
+        room_members_t *r = realloc(w->rooms, (size_t)cap * sizeof(*r));
+        if (!r) { perror("realloc"); return -1; }
+        memset(r + w->rooms_cap, 0, (size_t)(cap - w->rooms_cap) * sizeof(*r));
+        w->rooms = r;
+        w->rooms_cap = cap;
+    }
+    room_members_t *r = &w->rooms[room];
+    if (r->n == r->cap) {
+        int cap = r->cap ? r->cap * 2 : 16;
+        int *p = realloc(r->slots, (size_t)cap * sizeof(int));
+        if (!p) { perror("realloc"); return -1; }
+        r->slots = p;
+        r->cap = cap;
+    }
+    client_cold_t *cc = cold_at(w, slot);
+    cc->room = room;
+    cc->room_idx = r->n;
+    r->slots[r->n++] = slot;
+    room_pin(room);
+    return 0;
+}
+
+/* swap-remove a client from its room's member list */
+static void room_exit(worker_t *w, int slot) {
+    client_cold_t *cc = cold_at(w, slot);
+    if (cc->room < 0) return;
+    room_members_t *r = &w->rooms[cc->room];
+    int last = r->slots[--r->n];
+    r->slots[cc->room_idx] = last;
+    cold_at(w, last)->room_idx = cc->room_idx;
+    room_unpin(cc->room);
+    cc->room = -1;
+}
+
+static void cluster_publish(int kind, const char *room, const msgbuf_t *frame);
+
+/* broadcast to this worker's shard only: queue and move on, slow readers don't hold anyone up */
+static void broadcast_local(worker_t *w, const outmsg_t *msg, int except_fd) {
+    uint64_t t = now_ns();
+    PROF_BEGIN(span);
+    for (int i = 0; i < w->nlive; ++i) {
+        int slot = w->live[i];
+        if (client_at(w, slot)->fd != except_fd) client_send_out(w, slot, msg);
+    }
+    PROF_END(PS_FANOUT, span);
+    fanout_done(w, t);
+}
+
+/* broadcast to all except except_fd (-1 = none): local shard directly, other shards via their inbox */
+static void broadcast_except(worker_t *w, const outmsg_t *msg, int except_fd) {
+    if (!msg->text || !msg->bin) return;
+    PROF_BEGIN(span);
+    cluster_publish(LINK_ALL, NULL, msg->bin);
+    for (int i = 0; i < nworkers; ++i) {
+        if (&workers[i] != w) post_mail(&workers[i], MAIL_BROADCAST, -1, 0, except_fd, msg);
+    }
+    broadcast_local(w, msg, except_fd);
+    PROF_END(PS_FANOUT, span);
+}
+
+/* room fan-out on this shard: touches the room's members, not the whole shard */
+static void broadcast_room_local(worker_t *w, int room, const outmsg_t *msg, int except_fd) {
+    if (room >= w->rooms_cap) return;
+    uint64_t t = now_ns();
+    PROF_BEGIN(span);
+    room_members_t *r = &w->rooms[room];
+    for (int i = 0; i < r->n; ++i) {
+        int slot = r->slots[i];
+        if (client_at(w, slot)->fd != except_fd) client_send_out(w, slot, msg);
+    }
+    PROF_END(PS_FANOUT, span);
+    fanout_done(w, t);
+}
+
+/* broadcast to one room: members on this shard directly, other shards via their inbox */
+static void broadcast_room(worker_t *w, int room, const outmsg_t *msg, int except_fd) {
+    if (!msg->text || !msg->bin) return;
+    PROF_BEGIN(span);
+    cluster_publish(LINK_ROOM, room_names[room], msg->bin);
+    for (int i = 0; i < nworkers; ++i) {
+        if (&workers[i] != w) post_mail(&workers[i], MAIL_ROOM, room, atomic_load(&room_gen[room]), except_fd, msg);
+    }
+    broadcast_room_local(w, room, msg, except_fd);
+    PROF_END(PS_FANOUT, span);
+}
+
+/* remember a room message; takes its own references, evicting the oldest when full */
+static void history_push(int room, const outmsg_t *o) {
+    if (history_len <= 0 || !o->text || !o->bin) return;
+    room_hist_t *h = &room_hist[room];
+    pthread_mutex_lock(&h->mtx);
+    if (!h->ring) h->ring = calloc((size_t)history_len, sizeof(*h->ring));
+    if (h->ring) {
+        outmsg_t *e = &h->ring[(h->head + h->count) % (uint32_t)history_len];
+        if (h->count == (uint32_t)history_len) { out_release(e); h->head = (h->head + 1) % (uint32_t)history_len; }
+        else h->count++;
+        e->text = msg_ref(o->text);
+        e->bin = msg_ref(o->bin);
+        e->zbin = o->zbin ? msg_ref(o->zbin) : NULL;
+    }
+    pthread_mutex_unlock(&h->mtx);
+}
+
+/* queue the room's last n messages to one client; references are taken under the lock and the
+   queueing happens outside it. They leave with whatever else is pending in one gathered sendmsg. */
+static void history_replay(worker_t *w, int slot, int room, int n) {
+    if (history_len <= 0 || n <= 0) return;
+    if (n > history_len) n = history_len;
+    outmsg_t *tmp = malloc((size_t)n * sizeof(*tmp));
+    if (!tmp) return;
+    room_hist_t *h = &room_hist[room];
+    pthread_mutex_lock(&h->mtx);
+    uint32_t k = h->count < (uint32_t)n ? h->count : (uint32_t)n;
+    for (uint32_t i = 0; i < k; ++i) {
+        outmsg_t *e = &h->ring[(h->head + h->count - k + i) % (uint32_t)history_len];
+        tmp[i].text = msg_ref(e->text);
+        tmp[i].bin = msg_ref(e->bin);
+        tmp[i].zbin = e->zbin ? msg_ref(e->zbin) : NULL;
+    }
+    pthread_mutex_unlock(&h->mtx);
+    for (uint32_t i = 0; i < k; ++i) {
+        client_send_out(w, slot, &tmp[i]);
+        out_release(&tmp[i]);
+    }
+    free(tmp);
+}
+
+static size_t jrec_size(size_t len) {
+    return (sizeof(jrec_t) + len + 7) & ~(size_t)7;
+}
+
+/* worker side: hand a room message to the journal thread. Never blocks on I/O; a full queue drops. */
+static void journal_append(int room, const outmsg_t *o) {
+    if (!journal_running || !o->bin) return;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    pthread_mutex_lock(&jq_mtx);
+    if (jq_count == JOURNAL_QUEUE) {
+        pthread_mutex_unlock(&jq_mtx);
+        atomic_fetch_add_explicit(&stat_journal_drops, 1, memory_order_relaxed);
+        return;
+    }
+    jent_t *e = &jq[(jq_head + jq_count++) % JOURNAL_QUEUE];
+    e->bin = msg_ref(o->bin);
+    snprintf(e->room, NAME_LEN, "%s", room_names[room]);
+    e->ts = (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    if (jq_count == 1) pthread_cond_signal(&jq_cond);
+    pthread_mutex_unlock(&jq_mtx);
+}
+
+static void journal_path(char *buf, size_t cap, const char *dir, unsigned index) {
+    snprintf(buf, cap, "%s/journal-%08u.seg", dir, index);
+}
+
+/* end of the records in a mapped segment; a torn or corrupt record ends it too, so readers only ever
+   see a room name that fits NAME_LEN followed by a non-empty payload inside the mapping */
+static size_t journal_scan(const char *map, size_t size) {
+    size_t off = 0;
+    while (off + sizeof(jrec_t) <= size) {
+        const jrec_t *r = (const jrec_t *)(map + off);
+        if (r->magic != JREC_MAGIC || off + jrec_size(r->len) > size) break;
+        if (r->room_len >= NAME_LEN || r->room_len >= r->len) break;
+        off += jrec_size(r->len);
+    }
+    return off;
+}
+
+/* open (creating when new) a segment, preallocated to journal_seg and mapped for writing */
+static int journal_map(unsigned index) {
+    char path[4096];
+    journal_path(path, sizeof(path), journal_dir, index);
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) { perror(path); return -1; }
+    struct stat st;
+    if (fstat(fd, &st) < 0) { perror("fstat"); close(fd); return -1; }
+    size_t size = (size_t)st.st_size > journal_seg ? (size_t)st.st_size : journal_seg;
+    int err = posix_fallocate(fd, 0, (off_t)size);
+    if (err) { errno = err; perror("posix_fallocate"); close(fd); return -1; }
+    char *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) { perror("mmap"); close(fd); return -1; }
+    jseg_fd = fd;
+    jseg_index = index;
+    jseg_map = map;
+    jseg_off = journal_scan(map, (size_t)st.st_size < size ? (size_t)st.st_size : size);
+    journal_seg = size;
+    return 0;
+}
+
+/* flush and trim the current segment down to its records */
+static void journal_unmap(void) {
+    if (jseg_fd < 0) return;
+    msync(jseg_map, journal_seg, MS_SYNC);
+    munmap(jseg_map, journal_seg);
+    if (ftruncate(jseg_fd, (off_t)jseg_off) < 0) perror("ftruncate");
+    fsync(jseg_fd);
+    close(jseg_fd);
+    jseg_fd = -1;
+}
+
+static void journal_write(const jent_t *e) {
+    const char *room = e->room;
+    size_t rl = strlen(room), pl = e->bin->len - FRAME_HDR;
+    size_t need = jrec_size(rl + pl);
+    if (jseg_fd < 0 || jseg_off + need > journal_seg) {
+        unsigned next = jseg_fd < 0 ? jseg_index : jseg_index + 1;
+        journal_unmap();
+        if (journal_map(next) < 0) { atomic_fetch_add_explicit(&stat_journal_drops, 1, memory_order_relaxed); return; }
+    }
+    char *p = jseg_map + jseg_off;
+    jrec_t h = { .magic = 0, .len = (uint32_t)(rl + pl), .ts = e->ts, .id = (int64_t)get_be64((const unsigned char *)e->bin->data + 8),
+                 .room_len = (uint8_t)rl };
+    memcpy(p + sizeof(h), room, rl);
+    memcpy(p + sizeof(h) + rl, e->bin->data + FRAME_HDR, pl);
+    memcpy(p, &h, sizeof(h));
+    /* magic last, so a torn record at a crash reads as the end of the segment */
+    atomic_store_explicit((_Atomic uint32_t *)p, JREC_MAGIC, memory_order_release);
+    jseg_off += need;
+    atomic_fetch_add_explicit(&stat_journal_recs, 1, memory_order_relaxed);
+}
+
+/* journal thread: take everything queued, append it, drop the references */
+static void *journal_writer(void *arg) {
+    (void)arg;
+    jent_t batch[256];
+    for (;;) {
+        pthread_mutex_lock(&jq_mtx);
+        while (jq_count == 0 && !jq_stop) pthread_cond_wait(&jq_cond, &jq_mtx);
+        if (jq_count == 0) { pthread_mutex_unlock(&jq_mtx); break; }
+        uint32_t n = 0;
+        while (jq_count && n < sizeof(batch) / sizeof(batch[0])) {
+            batch[n++] = jq[jq_head];
+            jq_head = (jq_head + 1) % JOURNAL_QUEUE;
+            jq_count--;
+        }
+        pthread_mutex_unlock(&jq_mtx);
+        for (uint32_t i = 0; i < n; ++i) {
+            journal_write(&batch[i]);
+            msg_unref(batch[i].bin);
+        }
+    }
+    journal_unmap();
+    return NULL;
+}
+
+/* newest segment index in dir, -1 when there is none */
+static long journal_last(const char *dir) {
+    DIR *d = opendir(dir);
+    if (!d) return -1;
+    long last = -1;
+    struct dirent *de;
+    while ((de = readdir(d))) {
+        unsigned idx;
+        char tail;
+        if (sscanf(de->d_name, "journal-%8u.se%c", &idx, &tail) == 2 && tail == 'g' && (long)idx > last) last = idx;
+    }
+    closedir(d);
+    return last;
+}
+
+/* map a sealed or live segment read-only and hand each record to fn */
+static void journal_each(const char *dir, unsigned index, void (*fn)(const jrec_t *, const char *room, const char *payload)) {
+    char path[4096];
+    journal_path(path, sizeof(path), dir, index);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        char *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            size_t end = journal_scan(map, (size_t)st.st_size);
+            for (size_t off = 0; off < end;) {
+                const jrec_t *r = (const jrec_t *)(map + off);
+                fn(r, map + off + sizeof(*r), map + off + sizeof(*r) + r->room_len);
+                off += jrec_size(r->len);
+            }
+            munmap(map, (size_t)st.st_size);
+        }
+    }
+    close(fd);
+}
+
+/* startup: rebuild room history from the journal; single-threaded, before any worker runs */
+static void journal_load_rec(const jrec_t *r, const char *room, const char *payload) {
+    size_t pl = r->len - r->room_len;
+    if (pl < 1 || (size_t)(uint8_t)payload[0] + 1 > pl) return;
+    char rn[NAME_LEN], name[NAME_LEN];
+    snprintf(rn, sizeof(rn), "%.*s", (int)r->room_len, room);
+    snprintf(name, sizeof(name), "%.*s", (uint8_t)payload[0], payload + 1);
+    int id = room_register(rn, 1);
+    if (id < 0) return;
+    size_t skip = 1 + (uint8_t)payload[0];
+    outmsg_t o = chat_out(FRAME_MSG, r->id, name, payload + skip, pl - skip);
+    history_push(id, &o);
+    out_release(&o);
+    room_unpin(id);
+}
+
+static void journal_open(const char *dir) {
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) { perror(dir); exit(1); }
+    long last = journal_last(dir);
+    if (history_len > 0) {
+        for (long i = last - JOURNAL_LOAD_SEGS + 1 < 0 ? 0 : last - JOURNAL_LOAD_SEGS + 1; last >= 0 && i <= last; ++i)
+            journal_each(dir, (unsigned)i, journal_load_rec);
+    }
+    if (journal_map(last < 0 ? 0 : (unsigned)last) < 0) exit(1);
+    journal_running = 1;
+    if (pthread_create(&journal_thread, NULL, journal_writer, NULL) != 0) { perror("pthread_create"); exit(1); }
+}
+
+/* drain the queue, seal the segment */
+static void journal_close(void) {
+    if (!journal_running) return;
+    pthread_mutex_lock(&jq_mtx);
+    jq_stop = 1;
+    pthread_cond_signal(&jq_cond);
+    pthread_mutex_unlock(&jq_mtx);
+    pthread_join(journal_thread, NULL);
+    journal_running = 0;
+}
+
+/* --journal-dump: offline view, one line per record */
+static void journal_dump_rec(const jrec_t *r, const char *room, const char *payload) {
+    size_t pl = r->len - r->room_len;
+    if (pl < 1 || (size_t)(uint8_t)payload[0] + 1 > pl) return;
+    time_t secs = (time_t)(r->ts / 1000000000);
+    struct tm tm;
+    char when[32];
+    localtime_r(&secs, &tm);
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+    size_t skip = 1 + (uint8_t)payload[0];
+    printf("%s  #%.*s  %.*s (ID:%" PRId64 "): %.*s\n", when, (int)r->room_len, room,
+           (uint8_t)payload[0], payload + 1, r->id, (int)(pl - skip), payload + skip);
+}
+
+static int journal_dump(const char *dir) {
+    long last = journal_last(dir);
+    if (last < 0) { fprintf(stderr, "%s: no journal segments\n", dir); return 1; }
+    for (long i = 0; i <= last; ++i) journal_each(dir, (unsigned)i, journal_dump_rec);
+    return 0;
+}
+
+/* deliver to one client on whichever shard owns it */
+static void send_to(worker_t *w, int owner, int slot, int64_t id, const outmsg_t *msg) {
+    if (!msg->text || !msg->bin) return;
+    if (&workers[owner] != w) { post_mail(&workers[owner], MAIL_DELIVER, slot, id, -1, msg); return; }
+    client_t *c = client_at(w, slot);
+    if (c->alive && c->id == id) client_send_out(w, slot, msg);
+}
+
+static int dir_cmp_id(const void *a, const void *b) {
+    int64_t x = (*(const dir_entry_t *const *)a)->id, y = (*(const dir_entry_t *const *)b)->id;
+    return (x > y) - (x < y);
+}
+
+/* list users to a client: a text table, or FRAME_LIST entries */
+static void list_users(worker_t *w, int slot) {
+    int binary = client_at(w, slot)->proto == PROTO_BINARY;
+    char out[4096];
+    size_t pos = 0;
+    if (!binary) pos += snprintf(out + pos, sizeof(out) - pos, "=== Connected Users ===\n");
+
+    /* lock-free snapshot of the directory, shown in id order */
+    dir_table_t *t = atomic_load(&dir_tab);
+    const dir_entry_t **ents = malloc(t->cap * sizeof(*ents));
+    size_t n = 0;
+    for (size_t i = 0; ents && i < t->cap; ++i) {
+        const dir_entry_t *e = atomic_load(&t->slot[i]);
+        if (e && e != &dir_tomb) ents[n++] = e;
+    }
+    if (n) qsort(ents, n, sizeof(*ents), dir_cmp_id);
+    for (size_t i = 0; i < n && pos + 64 < sizeof(out); ++i) {
+        const dir_entry_t *e = ents[i];
+        if (binary) {
+            size_t nl = strlen(e->name);
+            put_be64((unsigned char *)out + pos, (uint64_t)e->id);
+            out[pos + 8] = (char)nl;
+            memcpy(out + pos + 9, e->name, nl);
+            pos += 9 + nl;
+        } else {
+            pos += snprintf(out + pos, sizeof(out) - pos, "ID:%" PRId64 "  %s\n", e->id, e->name);
+        }
+    }
+    free(ents);
+    if (binary) {
+        msgbuf_t *m = frame_new(FRAME_LIST, 0, NULL, out, pos);
+        client_send(w, slot, m);
+        msg_unref(m);
+        return;
+    }
+    pos += snprintf(out + pos, sizeof(out) - pos, "=======================\n");
+    client_notice(w, slot, out);
+}
+
+/* sum every worker's counters; each is read once, unlocked, so the totals are approximate but cheap */
+static void stats_collect(uint64_t sum[ST_COUNT]) {
+    memset(sum, 0, ST_COUNT * sizeof(uint64_t));
+    for (int i = 0; i < nworkers; ++i)
+        for (int k = 0; k < ST_COUNT; ++k) sum[k] += atomic_load_explicit(&workers[i].stats[k], memory_order_relaxed);
+}
+
+/* upper bound of the fan-out bucket holding quantile q, in ns (0 when nothing was recorded) */
+static uint64_t fanout_quantile(const uint64_t sum[ST_COUNT], double q) {
+    uint64_t want = (uint64_t)(q * (double)sum[ST_FANOUTS]), seen = 0;
+    for (int b = 0; b < FANOUT_BUCKETS; ++b) {
+        seen += sum[ST_FANOUT_HIST + b];
+        if (seen > want) return 1ull << (b + 8);
+    }
+    return 0;
+}
+
+static size_t log_depth(void) {
+    return atomic_load(&log_head) - atomic_load(&log_tail);
+}
+
+static int links_up(void) {
+    int n = 0;
+    for (int i = 0; i < npeers; ++i) {
+        pthread_mutex_lock(&peers[i].mtx);
+        n += peers[i].up;
+        pthread_mutex_unlock(&peers[i].mtx);
+    }
+    return n;
+}
+
+/* /stats: totals, plus rates over the time since the previous /stats from anyone */
+static void send_stats(worker_t *w, int slot) {
+    static pthread_mutex_t prev_mtx = PTHREAD_MUTEX_INITIALIZER;
+    static uint64_t prev[ST_COUNT], prev_ns;
+    uint64_t sum[ST_COUNT], now = now_ns();
+    stats_collect(sum);
+
+    pthread_mutex_lock(&prev_mtx);
+    double secs = (double)(now - (prev_ns ? prev_ns : start_ns)) / 1e9;
+    if (secs <= 0) secs = 1e-9;
+    double r_acc = (double)(sum[ST_ACCEPTS] - prev[ST_ACCEPTS]) / secs;
+    double r_in = (double)(sum[ST_MSGS_IN] - prev[ST_MSGS_IN]) / secs;
+    double r_out = (double)(sum[ST_MSGS_OUT] - prev[ST_MSGS_OUT]) / secs;
+    memcpy(prev, sum, sizeof(prev));
+    prev_ns = now;
+    pthread_mutex_unlock(&prev_mtx);
+
+    char out[1024];
+    snprintf(out, sizeof(out), "=== Server Stats ===\n"
+                               "clients: %d  uptime: %.0f s  workers: %d\n"
+                               "accepts: %" PRIu64 " (%.1f/s)\n"
+                               "messages in: %" PRIu64 " (%.1f/s)  out: %" PRIu64 " (%.1f/s)\n"
+                               "bytes in: %" PRIu64 "  out: %" PRIu64 "  queued: %" PRIu64 "\n"
+                               "deflated deliveries: %" PRIu64 " (%" PRIu64 " bytes saved, %d clients)\n"
+                               "fan-outs: %" PRIu64 "  avg %.1f us  p99 < %.1f us\n"
+                               "clients_mtx: %" PRIu64 " contended waits, %.3f ms waiting\n"
+                               "log queue: %zu records\n"
+                               "journal: %" PRIu64 " records, %" PRIu64 " dropped\n"
+                               "output drops: %" PRIu64 " messages (%" PRIu64 " bytes)\n"
+                               "slow-consumer evictions: %" PRIu64 "\n"
+                               "rate-limited messages: %" PRIu64 "\n"
+                               "log records dropped: %" PRIu64 "\n"
+                               "cluster: node %d, %d of %d links up, records out %" PRIu64 " in %" PRIu64 " dropped %" PRIu64 "\n"
+                               "====================\n",
+             atomic_load(&nclients), (double)(now - start_ns) / 1e9, nworkers,
+             sum[ST_ACCEPTS], r_acc, sum[ST_MSGS_IN], r_in, sum[ST_MSGS_OUT], r_out,
+             sum[ST_BYTES_IN], sum[ST_BYTES_OUT], sum[ST_OUT_QUEUED],
+             sum[ST_ZIP_OUT], sum[ST_ZIP_SAVED], atomic_load(&zip_clients),
+             sum[ST_FANOUTS], sum[ST_FANOUTS] ? (double)sum[ST_FANOUT_NS] / (double)sum[ST_FANOUTS] / 1e3 : 0.0,
+             (double)fanout_quantile(sum, 0.99) / 1e3,
+             sum[ST_LOCK_WAITS], (double)sum[ST_LOCK_WAIT_NS] / 1e6, log_depth(),
+             (uint64_t)atomic_load(&stat_journal_recs), (uint64_t)atomic_load(&stat_journal_drops),
+             (uint64_t)atomic_load(&stat_drop_msgs), (uint64_t)atomic_load(&stat_drop_bytes),
+             (uint64_t)atomic_load(&stat_evictions), (uint64_t)atomic_load(&stat_rate_drops),
+             (uint64_t)atomic_load(&stat_log_drops), node_id, links_up(), npeers, (uint64_t)atomic_load(&stat_link_out),
+             (uint64_t)atomic_load(&stat_link_in), (uint64_t)atomic_load(&stat_link_drops));
+    client_notice(w, slot, out);
+}
+
+#ifdef CHAT_PROFILE
+/* sum every thread's profile and print it; counted without stopping anyone, so totals are approximate */
+static void prof_dump(void) {
+    static const char *stage[PS_COUNT] = { "lock wait", "lock hold", "recv", "parse", "format", "deflate", "fan-out", "mail", "send", "log" };
+    static const char *sys[PC_COUNT] = { "recv", "sendmsg", "epoll_wait/io_uring_enter", "accept4", "eventfd", "timerfd" };
+    uint64_t hist[PS_COUNT][PROF_BUCKETS] = { { 0 } }, ns[PS_COUNT] = { 0 }, calls[PC_COUNT] = { 0 };
+    int nt = atomic_load(&prof_nthreads);
+    if (nt > PROF_THREADS) nt = PROF_THREADS;
+    for (int t = 0; t < nt; ++t) {
+        prof_t *p = prof_all[t];
+        if (!p) continue;
+        for (int i = 0; i < PS_COUNT; ++i) {
+            ns[i] += atomic_load_explicit(&p->ns[i], memory_order_relaxed);
+            for (int b = 0; b < PROF_BUCKETS; ++b) hist[i][b] += atomic_load_explicit(&p->hist[i][b], memory_order_relaxed);
+        }
+        for (int i = 0; i < PC_COUNT; ++i) calls[i] += atomic_load_explicit(&p->sys[i], memory_order_relaxed);
+    }
+    uint64_t sum[ST_COUNT];
+    stats_collect(sum);
+    uint64_t msgs = sum[ST_MSGS_IN] ? sum[ST_MSGS_IN] : 1;
+
+    fprintf(stderr, "=== profile: %d threads, %" PRIu64 " messages in ===\n"
+                    "%-10s %12s %12s %10s %10s %10s %10s\n", nt, sum[ST_MSGS_IN], "stage", "count", "self ms", "mean us", "p50 <us", "p99 <us", "max <us");
+    for (int i = 0; i < PS_COUNT; ++i) {
+        uint64_t n = 0;
+        for (int b = 0; b < PROF_BUCKETS; ++b) n += hist[i][b];
+        if (!n) continue;
+        double q[3] = { 0 };
+        const double at[3] = { 0.5, 0.99, 1.0 };
+        for (int k = 0; k < 3; ++k) {
+            uint64_t need = (uint64_t)((double)n * at[k] + 0.5), seen = 0;
+            if (need < 1) need = 1;
+            for (int b = 0; b < PROF_BUCKETS; ++b) {
+                seen += hist[i][b];
+                if (seen >= need) { q[k] = (double)(1ull << b) / 1e3; break; }
+            }
+        }
+        fprintf(stderr, "%-10s %12" PRIu64 " %12.3f %10.3f %10.3f %10.3f %10.3f\n", stage[i], n, (double)ns[i] / 1e6,
+                (double)ns[i] / (double)n / 1e3, q[0], q[1], q[2]);
+    }
+    fprintf(stderr, "%-26s %12s %12s\n", "syscall", "calls", "per msg in");
+    for (int i = 0; i < PC_COUNT; ++i)
+        fprintf(stderr, "%-26s %12" PRIu64 " %12.3f\n", sys[i], calls[i], (double)calls[i] / (double)msgs);
+}
+#endif
+
+/* Prometheus text exposition of the same counters; returns the length written */
+static size_t stats_prom(char *out, size_t cap) {
+    static const struct { int idx; const char *name, *type, *help; } m[] = {
+        { ST_ACCEPTS,      "chat_accepts_total",            "counter", "Connections accepted" },
+        { ST_MSGS_IN,      "chat_messages_in_total",        "counter", "Lines and frames received from clients" },
+        { ST_MSGS_OUT,     "chat_messages_out_total",       "counter", "Messages queued to clients" },
+        { ST_BYTES_IN,     "chat_bytes_in_total",           "counter", "Bytes read from clients" },
+        { ST_BYTES_OUT,    "chat_bytes_out_total",          "counter", "Bytes written to clients" },
+        { ST_OUT_QUEUED,   "chat_output_queued_bytes",      "gauge",   "Bytes queued to clients and not yet written" },
+        { ST_LOCK_WAITS,   "chat_clients_mtx_waits_total",  "counter", "Contended acquisitions of clients_mtx" },
+        { ST_ZIP_OUT,      "chat_deflated_out_total",       "counter", "Messages queued deflated to FRAME_F_DEFLATE clients" },
+        { ST_ZIP_SAVED,    "chat_deflate_saved_bytes_total", "counter", "Output bytes saved by deflate" },
+    };
+    uint64_t sum[ST_COUNT];
+    stats_collect(sum);
+    size_t pos = 0;
+#define PROM(...) do { int k_ = snprintf(out + pos, pos < cap ? cap - pos : 0, __VA_ARGS__); if (k_ > 0) pos += (size_t)k_; } while (0)
+    for (size_t i = 0; i < sizeof(m) / sizeof(m[0]); ++i)
+        PROM("# HELP %s %s\n# TYPE %s %s\n%s %" PRIu64 "\n", m[i].name, m[i].help, m[i].name, m[i].type, m[i].name, sum[m[i].idx]);
+    PROM("# HELP chat_clients_mtx_wait_seconds_total Time spent waiting for clients_mtx\n"
+         "# TYPE chat_clients_mtx_wait_seconds_total counter\nchat_clients_mtx_wait_seconds_total %.9f\n", (double)sum[ST_LOCK_WAIT_NS] / 1e9);
+    PROM("# HELP chat_clients Connected clients\n# TYPE chat_clients gauge\nchat_clients %d\n", atomic_load(&nclients));
+    PROM("# HELP chat_log_queue_records Log records waiting for the writer thread\n"
+         "# TYPE chat_log_queue_records gauge\nchat_log_queue_records %zu\n", log_depth());
+    PROM("# HELP chat_log_dropped_total Log records dropped on a full ring\n"
+         "# TYPE chat_log_dropped_total counter\nchat_log_dropped_total %" PRIu64 "\n", (uint64_t)atomic_load(&stat_log_drops));
+    PROM("# HELP chat_journal_records_total Records appended to the journal\n"
+         "# TYPE chat_journal_records_total counter\nchat_journal_records_total %" PRIu64 "\n", (uint64_t)atomic_load(&stat_journal_recs));
+    PROM("# HELP chat_journal_dropped_total Records dropped on a full journal queue or failed segment\n"
+         "# TYPE chat_journal_dropped_total counter\nchat_journal_dropped_total %" PRIu64 "\n", (uint64_t)atomic_load(&stat_journal_drops));
+    PROM("# HELP chat_output_dropped_total Messages shed by the slow-consumer policy\n"
+         "# TYPE chat_output_dropped_total counter\nchat_output_dropped_total %" PRIu64 "\n", (uint64_t)atomic_load(&stat_drop_msgs));
+    PROM("# HELP chat_evictions_total Clients disconnected as slow consumers\n"
+         "# TYPE chat_evictions_total counter\nchat_evictions_total %" PRIu64 "\n", (uint64_t)atomic_load(&stat_evictions));
+    PROM("# HELP chat_rate_limited_total Client messages rejected by a rate limit\n"
+         "# TYPE chat_rate_limited_total counter\nchat_rate_limited_total %" PRIu64 "\n", (uint64_t)atomic_load(&stat_rate_drops));
+    PROM("# HELP chat_cluster_records_out_total Records queued to other nodes\n"
+         "# TYPE chat_cluster_records_out_total counter\nchat_cluster_records_out_total %" PRIu64 "\n", (uint64_t)atomic_load(&stat_link_out));
+    PROM("# HELP chat_cluster_records_in_total Records delivered from other nodes\n"
+         "# TYPE chat_cluster_records_in_total counter\nchat_cluster_records_in_total %" PRIu64 "\n", (uint64_t)atomic_load(&stat_link_in));
+    PROM("# HELP chat_cluster_dropped_total Records dropped on a down or backed-up link\n"
+         "# TYPE chat_cluster_dropped_total counter\nchat_cluster_dropped_total %" PRIu64 "\n", (uint64_t)atomic_load(&stat_link_drops));
+    PROM("# HELP chat_fanout_seconds Time to queue one broadcast to a shard's recipients\n# TYPE chat_fanout_seconds histogram\n");
+    uint64_t cum = 0;
+    for (int b = 0; b < FANOUT_BUCKETS - 1; ++b) {
+        cum += sum[ST_FANOUT_HIST + b];
+        PROM("chat_fanout_seconds_bucket{le=\"%.9f\"} %" PRIu64 "\n", (double)(1ull << (b + 8)) / 1e9, cum);
+    }
+    PROM("chat_fanout_seconds_bucket{le=\"+Inf\"} %" PRIu64 "\n", sum[ST_FANOUTS]);
+    PROM("chat_fanout_seconds_sum %.9f\nchat_fanout_seconds_count %" PRIu64 "\n", (double)sum[ST_FANOUT_NS] / 1e9, sum[ST_FANOUTS]);
+#undef PROM
+    return pos < cap ? pos : cap - 1;
+}
+
+/* --metrics-port: one request per connection, answered with the exposition and closed */
+static void *metrics_loop(void *arg) {
+    int lfd = (int)(intptr_t)arg;
+    while (1) {
+        int fd = accept(lfd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            perror("metrics accept");
+            return NULL;
+        }
+        struct timeval tv = { 1, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        char req[1024];
+        if (recv(fd, req, sizeof(req), 0) > 0) {
+            char body[8192], hdr[160];
+            size_t n = stats_prom(body, sizeof(body));
+            int hl = snprintf(hdr, sizeof(hdr), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                                                "Content-Length: %zu\r\nConnection: close\r\n\r\n", n);
+            if (send_all(fd, hdr, (size_t)hl) == 0) send_all(fd, body, n);
+        }
+        close(fd);
+    }
+}
+
+static void metrics_start(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) { perror("socket"); exit(1); }
+    int opt = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK); /* admin surface: local scrapers only */
+    addr.sin_port = htons((uint16_t)port);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) { perror("metrics bind"); exit(1); }
+    if (listen(fd, BACKLOG) < 0) { perror("metrics listen"); exit(1); }
+    pthread_t t;
+    if (pthread_create(&t, NULL, metrics_loop, (void *)(intptr_t)fd) != 0) { perror("pthread_create"); exit(1); }
+    pthread_detach(t);
+}
+
+/* the peer whose node owns a client id; NULL for local ids and when standalone */
+static peer_t *peer_of(int64_t id) {
+    if (node_id < 0 || id <= 0 || (id & (MAX_NODES - 1)) == node_id) return NULL;
+    for (int i = 0; i < npeers; ++i) if (peers[i].node == (id & (MAX_NODES - 1))) return &peers[i];
+    return NULL;
+}
+
+static int link_reserve(char **buf, size_t *cap, size_t need) {
+    if (need <= *cap) return 0;
+    size_t c = *cap ? *cap : 4096;
+    while (c < need) c *= 2;
+    char *b = realloc(*buf, c);
+    if (!b) { perror("realloc"); return -1; }
+    *buf = b;
+    *cap = c;
+    return 0;
+}
+
+static void link_put(unsigned char *h, int kind, const char *room, size_t rl, const msgbuf_t *frame, int64_t to) {
+    h[0] = (unsigned char)kind;
+    h[1] = (unsigned char)rl;
+    h[2] = h[3] = 0;
+    put_be32(h + 4, (uint32_t)frame->len);
+    put_be64(h + 8, (uint64_t)to);
+    if (rl) memcpy(h + LINK_HDR, room, rl);
+    memcpy(h + LINK_HDR + rl, frame->data, frame->len);
+}
+
+/* append one record to a peer's batch; dropped (and counted) while the link is down or too far behind.
+   0 once queued, which only means the link took it: a link that goes down still loses it */
+static int link_queue(peer_t *p, int kind, const char *room, const msgbuf_t *frame, int64_t to) {
+    if (!frame) return -1;
+    size_t rl = room ? strlen(room) : 0, need = LINK_HDR + rl + frame->len;
+    pthread_mutex_lock(&p->mtx);
+    if (!p->up || p->len + need > LINK_BUF_MAX || link_reserve(&p->buf, &p->cap, p->len + need) < 0) {
+        pthread_mutex_unlock(&p->mtx);
+        atomic_fetch_add_explicit(&stat_link_drops, 1, memory_order_relaxed);
+        return -1;
+    }
+    link_put((unsigned char *)p->buf + p->len, kind, room, rl, frame, to);
+    int was_empty = p->len == 0;
+    p->len += need;
+    pthread_mutex_unlock(&p->mtx);
+    atomic_fetch_add_explicit(&stat_link_out, 1, memory_order_relaxed);
+    if (was_empty) {
+        uint64_t one = 1;
+        if (write(cluster_wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) perror("eventfd write");
+    }
+    return 0;
+}
+
+/* one record per peer, not one per remote user: every node fans out to its own clients */
+static void cluster_publish(int kind, const char *room, const msgbuf_t *frame) {
+    for (int i = 0; i < npeers; ++i) link_queue(&peers[i], kind, room, frame, 0);
+}
+
+/* both renderings of a frame that came over a link; NULLs for anything that isn't a notice or chat */
+static outmsg_t link_out(const unsigned char *f, size_t len) {
+    outmsg_t o = { NULL, NULL, NULL };
+    const unsigned char *p = f + FRAME_HDR;
+    size_t plen = len - FRAME_HDR;
+    int64_t id = (int64_t)get_be64(f + 8);
+    if (f[0] == FRAME_SERVER) {
+        o.text = msg_fmt("%.*s\n", (int)plen, (const char *)p);
+        o.bin = msg_new((const char *)f, len);
+    } else if (f[0] == FRAME_CHUNK && (f[1] & FRAME_F_ABORT)) {
+        o = chunk_abort(id, (unsigned)f[2] << 8 | f[3]);
+    } else if ((f[0] == FRAME_MSG || f[0] == FRAME_PM || f[0] == FRAME_CHUNK) && plen >= 1 && p[0] < NAME_LEN && 1 + (size_t)p[0] <= plen) {
+        char name[NAME_LEN];
+        memcpy(name, p + 1, p[0]);
+        name[p[0]] = '\0';
+        o = chat_out(f[0], id, name, (const char *)p + 1 + p[0], plen - 1 - p[0]);
+        if (f[0] == FRAME_CHUNK) chunk_mark(&o, f[1] & FRAME_F_MORE, (unsigned)f[2] << 8 | f[3]);
+    }
+    return o;
+}
+
+/* hand a remote record to the workers; runs on the cluster thread */
+static void link_deliver(int kind, const char *room, const unsigned char *f, size_t len, int64_t to) {
+    if (len < FRAME_HDR || get_be32(f + 4) != len - FRAME_HDR) return;
+    outmsg_t o = link_out(f, len);
+    if (!o.text || !o.bin) { out_release(&o); return; }
+    atomic_fetch_add_explicit(&stat_link_in, 1, memory_order_relaxed);
+    if (kind == LINK_ALL) {
+        for (int i = 0; i < nworkers; ++i) post_mail(&workers[i], MAIL_BROADCAST, -1, 0, -1, &o);
+    } else if (kind == LINK_ROOM) {
+        /* only rooms this node already knows: a link creates none, so peers can't fill the registry */
+        clients_lock(NULL);
+        int r = room_register(room, 0);
+        clients_unlock();
+        if (r >= 0) {
+            unsigned gen = atomic_load(&room_gen[r]);
+            for (int i = 0; i < nworkers; ++i) post_mail(&workers[i], MAIL_ROOM, r, gen, -1, &o);
+            if (f[0] == FRAME_MSG) { history_push(r, &o); journal_append(r, &o); }
+            room_unpin(r);
+        }
+    } else if (kind == LINK_TO) {
+        /* not an RCU reader: look the id up under the writers' lock instead */
+        clients_lock(NULL);
+        const dir_entry_t *d = dir_find(to);
+        int owner = d ? d->worker : -1, slot = d ? d->slot : -1;
+        clients_unlock();
+        if (owner >= 0) {
+            post_mail(&workers[owner], MAIL_DELIVER, slot, to, -1, &o);
+        } else if (f[0] == FRAME_PM) {
+            int64_t from = (int64_t)get_be64(f + 8);
+            peer_t *p = peer_of(from);
+            msgbuf_t *m = frame_new(FRAME_SERVER, 0, NULL, "User not found.", 15);
+            if (p) link_queue(p, LINK_TO, NULL, m, from);
+            msg_unref(m);
+        }
+    }
+    out_release(&o);
+}
+
+/* records in a batch that end past off, i.e. were not completely written; the greeting isn't one */
+static unsigned link_unsent(const char *buf, size_t len, size_t off) {
+    unsigned n = 0;
+    for (size_t at = 0; at + LINK_HDR <= len;) {
+        const unsigned char *h = (const unsigned char *)buf + at;
+        at += LINK_HDR + h[1] + get_be32(h + 4);
+        if (at > off && h[0] != LINK_HELLO) n++;
+    }
+    return n;
+}
+
+/* whatever was queued or half written is lost with the link, and counted as dropped */
+static void link_down(peer_t *p) {
+    if (p->fd >= 0) {
+        close(p->fd);
+        log_event("CLUSTER link to node %d down", p->node);
+    }
+    unsigned lost = link_unsent(p->out, p->out_len, p->out_off);
+    p->fd = -1;
+    p->connecting = 0;
+    p->out_len = p->out_off = 0;
+    p->retry_at = now_ns() + LINK_RETRY_MS * 1000000ull;
+    pthread_mutex_lock(&p->mtx);
+    lost += link_unsent(p->buf, p->len, 0);
+    p->up = 0;
+    p->len = 0;
+    pthread_mutex_unlock(&p->mtx);
+    if (lost) atomic_fetch_add_explicit(&stat_link_drops, lost, memory_order_relaxed);
+}
+
+static void link_dial(peer_t *p) {
+    p->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (p->fd < 0) { perror("socket"); p->retry_at = now_ns() + LINK_RETRY_MS * 1000000ull; return; }
+    int one = 1;
+    setsockopt(p->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(p->fd, (struct sockaddr *)&p->addr, sizeof(p->addr)) == 0 || errno == EINPROGRESS) p->connecting = 1;
+    else { close(p->fd); p->fd = -1; p->retry_at = now_ns() + LINK_RETRY_MS * 1000000ull; }
+}
+
+/* connect finished: the greeting goes out as the first batch, ahead of anything workers queue */
+static void link_connected(peer_t *p) {
+    int err = 0;
+    socklen_t el = sizeof(err);
+    if (getsockopt(p->fd, SOL_SOCKET, SO_ERROR, &err, &el) < 0 || err) {
+        close(p->fd);
+        p->fd = -1;
+        p->connecting = 0;
+        p->retry_at = now_ns() + LINK_RETRY_MS * 1000000ull;
+        return;
+    }
+    p->connecting = 0;
+    msgbuf_t *hello = frame_new(FRAME_HELLO, node_id, NULL, LINK_MAGIC, strlen(LINK_MAGIC));
+    if (!hello || link_reserve(&p->out, &p->out_cap, LINK_HDR + hello->len) < 0) { msg_unref(hello); link_down(p); return; }
+    link_put((unsigned char *)p->out, LINK_HELLO, NULL, 0, hello, 0);
+    p->out_len = LINK_HDR + hello->len;
+    p->out_off = 0;
+    msg_unref(hello);
+    pthread_mutex_lock(&p->mtx);
+    p->up = 1;
+    pthread_mutex_unlock(&p->mtx);
+    log_event("CLUSTER link to node %d up", p->node);
+}
+
+/* write the current batch; when it is done, take whatever queued meanwhile as the next one */
+static void link_pump(peer_t *p) {
+    while (1) {
+        if (p->out_off == p->out_len) {
+            pthread_mutex_lock(&p->mtx);
+            char *b = p->buf;
+            size_t cap = p->cap;
+            p->buf = p->out;
+            p->cap = p->out_cap;
+            p->out = b;
+            p->out_cap = cap;
+            p->out_len = p->len;
+            p->out_off = 0;
+            p->len = 0;
+            pthread_mutex_unlock(&p->mtx);
+            if (!p->out_len) return;
+        }
+        ssize_t n = send(p->fd, p->out + p->out_off, p->out_len - p->out_off, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+        if (n <= 0) { link_down(p); return; }
+        p->out_off += (size_t)n;
+    }
+}
+
+/* is there a --peer for this node (any node when node < 0) at this address */
+static int peer_at(int64_t node, struct in_addr a) {
+    for (int i = 0; i < npeers; ++i)
+        if ((node < 0 || peers[i].node == node) && peers[i].addr.sin_addr.s_addr == a.s_addr) return 1;
+    return 0;
+}
+
+/* read an inbound link and deliver every complete record; -1 when the link should be closed */
+static int link_read(link_in_t *l) {
+    while (1) {
+        ssize_t n = recv(l->fd, l->buf + l->len, LINK_IN_BUF - l->len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+        if (n <= 0) return -1;
+        l->len += (size_t)n;
+        size_t off = 0;
+        while (l->len - off >= LINK_HDR) {
+            const unsigned char *h = (const unsigned char *)l->buf + off;
+            size_t rl = h[1], fl = get_be32(h + 4), total = LINK_HDR + rl + fl;
+            if (total > LINK_IN_BUF || rl >= NAME_LEN) return -1;
+            if (l->len - off < total) break;
+            char room[NAME_LEN];
+            memcpy(room, h + LINK_HDR, rl);
+            room[rl] = '\0';
+            const unsigned char *f = h + LINK_HDR + rl;
+            if (!l->greeted) {
+                if (h[0] != LINK_HELLO || fl != FRAME_HDR + strlen(LINK_MAGIC) || memcmp(f + FRAME_HDR, LINK_MAGIC, strlen(LINK_MAGIC)) != 0) return -1;
+                int64_t node = (int64_t)get_be64(f + 8);
+                if (!peer_at(node, l->from)) {
+                    log_event("CLUSTER link from %s claims node %" PRId64 ", not a --peer there; closed", inet_ntoa(l->from), node);
+                    return -1;
+                }
+                l->greeted = 1;
+                log_event("CLUSTER link from node %" PRId64 " up", node);
+            } else {
+                link_deliver(h[0], room, f, fl, (int64_t)get_be64(h + 8));
+            }
+            off += total;
+        }
+        memmove(l->buf, l->buf + off, l->len - off);
+        l->len -= off;
+    }
+}
+
+/* the cluster thread: dials peers, writes their batches, and reads and delivers inbound links */
+static void *cluster_loop(void *arg) {
+    int lfd = (int)(intptr_t)arg;
+    link_in_t in[LINK_IN_MAX];
+    int nin = 0;
+    while (1) {
+        struct pollfd pf[2 + MAX_NODES + LINK_IN_MAX];
+        int np = 0;
+        pf[np++] = (struct pollfd){ .fd = lfd, .events = POLLIN };
+        pf[np++] = (struct pollfd){ .fd = cluster_wake_fd, .events = POLLIN };
+        uint64_t now = now_ns();
+        for (int i = 0; i < npeers; ++i) {
+            peer_t *p = &peers[i];
+            if (p->fd < 0 && now >= p->retry_at) link_dial(p);
+            if (p->fd >= 0 && !p->connecting) link_pump(p);
+            short ev = p->fd < 0 ? 0 : POLLIN | (p->connecting || p->out_off < p->out_len ? POLLOUT : 0);
+            pf[np++] = (struct pollfd){ .fd = p->fd, .events = ev };
+        }
+        for (int i = 0; i < nin; ++i) pf[np++] = (struct pollfd){ .fd = in[i].fd, .events = POLLIN };
+
+        if (poll(pf, (nfds_t)np, LINK_RETRY_MS) < 0) {
+            if (errno == EINTR) continue;
+            perror("cluster poll");
+            return NULL;
+        }
+        if (pf[1].revents) {
+            uint64_t cnt;
+            if (read(cluster_wake_fd, &cnt, sizeof(cnt)) < 0) { /* spurious */ }
+        }
+        for (int i = 0; i < npeers; ++i) {
+            peer_t *p = &peers[i];
+            short re = pf[2 + i].revents;
+            if (p->fd < 0 || !re) continue;
+            if (p->connecting) { link_connected(p); continue; }
+            if (re & (POLLIN | POLLERR | POLLHUP)) {
+                char junk[256]; /* peers never write on our outbound link; readable means closed */
+                ssize_t n = recv(p->fd, junk, sizeof(junk), MSG_DONTWAIT);
+                if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) { link_down(p); continue; }
+            }
+        }
+        for (int i = nin - 1; i >= 0; --i) {
+            if (!pf[2 + npeers + i].revents || link_read(&in[i]) == 0) continue;
+            close(in[i].fd);
+            free(in[i].buf);
+            in[i] = in[--nin];
+        }
+        if (pf[0].revents) {
+            int fd;
+            struct sockaddr_in sa;
+            socklen_t sl = sizeof(sa);
+            while ((fd = accept4(lfd, (struct sockaddr *)&sa, &sl, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+                sl = sizeof(sa);
+                if (!peer_at(-1, sa.sin_addr)) {
+                    log_event("CLUSTER link from %s refused: not a --peer", inet_ntoa(sa.sin_addr));
+                    close(fd);
+                    continue;
+                }
+                char *b = nin < LINK_IN_MAX ? malloc(LINK_IN_BUF) : NULL;
+                if (!b) { close(fd); continue; }
+                in[nin++] = (link_in_t){ .fd = fd, .greeted = 0, .from = sa.sin_addr, .buf = b, .len = 0 };
+            }
+        }
+    }
+}
+
+/* --peer N=HOST:PORT */
+static int peer_add(const char *spec) {
+    char host[64];
+    int node, port;
+    if (npeers == MAX_NODES || sscanf(spec, "%d=%63[^:]:%d", &node, host, &port) != 3 || node < 0 || node >= MAX_NODES) return -1;
+    peer_t *p = &peers[npeers];
+    p->addr.sin_family = AF_INET;
+    p->addr.sin_port = htons((uint16_t)port);
+    if (inet_pton(AF_INET, host, &p->addr.sin_addr) != 1) return -1;
+    p->node = node;
+    p->fd = -1;
+    pthread_mutex_init(&p->mtx, NULL);
+    npeers++;
+    return 0;
+}
+
+static void cluster_start(void) {
+    cluster_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (cluster_wake_fd < 0) { perror("eventfd"); exit(1); }
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) { perror("socket"); exit(1); }
+    int opt = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_addr = cluster_bind;
+    addr.sin_port = htons((uint16_t)cluster_port);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) { perror("cluster bind"); exit(1); }
+    if (listen(fd, BACKLOG) < 0) { perror("cluster listen"); exit(1); }
+    pthread_t t;
+    if (pthread_create(&t, NULL, cluster_loop, (void *)(intptr_t)fd) != 0) { perror("pthread_create"); exit(1); }
+    pthread_detach(t);
+}
+
+/* greet a freshly accepted client and announce it */
+static void client_open(worker_t *w, int slot) {
+    client_t *c = client_at(w, slot);
+    client_cold_t *cc = cold_at(w, slot);
+
+    /* welcome (text: the protocol isn't known until the client speaks) */
+    msgbuf_t *m = msg_fmt("Welcome %s (ID:%" PRId64 ")\nCommands: /name <new>, /list, /msg <id> <text>, /join <room>, /leave, /history <n>, /stats, /quit\n", cc->name, c->id);
+    client_send(w, slot, m);
+    msg_unref(m);
+
+    /* announce */
+    outmsg_t o = notice_fmt("[Server] %s (ID:%" PRId64 ") joined.\n", cc->name, c->id);
+    broadcast_except(w, &o, c->fd);
+    out_release(&o);
+    history_replay(w, slot, cc->room, history_len);
+    log_event("CONNECT id=%" PRId64 " name=%s", c->id, cc->name);
+}
+
+static void xfer_cut_all(worker_t *w, int slot);
+
+/* announce departure and free the slot */
+static void client_close(worker_t *w, int slot) {
+    client_t *c = client_at(w, slot);
+    client_cold_t *cc = cold_at(w, slot);
+    if (c->handshake) { remove_client(w, slot); return; } /* never announced */
+    xfer_cut_all(w, slot);
+    outmsg_t o = notice_fmt("[Server] %s (ID:%" PRId64 ") disconnected.\n", cc->name, c->id);
+    broadcast_except(w, &o, c->fd);
+    out_release(&o);
+    log_event("DISCONNECT id=%" PRId64 " name=%s", c->id, cc->name);
+    remove_client(w, slot);
+}
+
+/* a client's timer fired: close it, ping it, or re-arm for whatever is due next */
+static void client_timer(worker_t *w, int slot) {
+    client_t *c = client_at(w, slot);
+    client_cold_t *cc = cold_at(w, slot);
+    uint64_t quiet = w->tick - cc->last_rx;
+    if (c->handshake) {
+        log_event("TLS id=%" PRId64 " handshake timed out after %" PRIu64 "ms", c->id, quiet * TICK_MS);
+        remove_client(w, slot);
+        return;
+    }
+    if ((idle_ticks && quiet >= idle_ticks) || (ping_ticks && quiet >= 2 * ping_ticks)) {
+        log_event("TIMEOUT id=%" PRId64 " idle=%" PRIu64 "ms", c->id, quiet * TICK_MS);
+        client_notice_flush(w, slot, ping_ticks && quiet >= 2 * ping_ticks ? "No answer to ping, disconnecting.\n" : "Idle timeout.\n");
+        client_close(w, slot);
+        return;
+    }
+    if (ping_ticks && quiet >= ping_ticks) {
+        msgbuf_t *m = c->proto == PROTO_BINARY ? frame_new(FRAME_PING, 0, NULL, "", 0) : msg_new("PING\n", 5);
+        client_send(w, slot, m);
+        msg_unref(m);
+    }
+    wheel_add(w, slot, client_deadline(c, cc, w->tick));
+}
+
+/* one tick: cascade the upper levels that are due, then fire the level 0 bucket */
+static void wheel_advance(worker_t *w) {
+    uint64_t t = ++w->tick;
+    for (int lvl = 1; lvl < WHEEL_LEVELS && !(t & ((1ull << (WHEEL_BITS * lvl)) - 1)); ++lvl) {
+        int b = lvl * WHEEL_SIZE + (int)((t >> (WHEEL_BITS * lvl)) & (WHEEL_SIZE - 1));
+        int slot = w->wheel[b];
+        w->wheel[b] = -1;
+        while (slot >= 0) {
+            client_cold_t *cc = cold_at(w, slot);
+            int next = cc->tnext;
+            wheel_add(w, slot, client_deadline(client_at(w, slot), cc, t));
+            slot = next;
+        }
+    }
+    int b = (int)(t & (WHEEL_SIZE - 1));
+    int slot;
+    while ((slot = w->wheel[b]) >= 0) {
+        wheel_del(w, slot);
+        client_timer(w, slot);
+    }
+}
+
+/* timerfd readable: run every tick that has elapsed */
+static void worker_ticks(worker_t *w) {
+    uint64_t n;
+    PROF_SYS(PC_TIMERFD);
+    if (read(w->timer_fd, &n, sizeof(n)) != sizeof(n)) return;
+    while (n--) wheel_advance(w);
+}
+
+/* /name: control characters can't reach other clients' terminals or break text framing */
+static void cmd_name(worker_t *w, int slot, const char *newn, size_t len) {
+    client_t *c = client_at(w, slot);
+    client_cold_t *cc = cold_at(w, slot);
+    if (len == 0) { client_notice(w, slot, "Usage: /name <newname>\n"); return; }
+
+    /* safe bounded copy for name to avoid truncation warnings */
+    size_t nl = len < NAME_LEN - 1 ? len : NAME_LEN - 1;
+    for (size_t i = 0; i < nl; ++i) cc->name[i] = (unsigned char)newn[i] < 0x20 ? '_' : newn[i];
+    cc->name[nl] = '\0';
+    free(cc->hdr);
+    cc->hdr = NULL;
+    clients_lock(w);
+    dir_rename(c->id, cc->name);
+    clients_unlock();
+
+    outmsg_t o = notice_fmt("[Server] ID %" PRId64 " is now known as %s\n", c->id, cc->name);
+    broadcast_except(w, &o, -1);
+    out_release(&o);
+    log_event("RENAME id=%" PRId64 " name=%s", c->id, cc->name);
+}
+
+/* /msg */
+static void cmd_msg(worker_t *w, int slot, int64_t tid, const char *text, size_t len) {
+    client_t *c = client_at(w, slot);
+    client_cold_t *cc = cold_at(w, slot);
+    int owner, tslot;
+    peer_t *p = peer_of(tid);
+    if (p || find_by_id(tid, &owner, &tslot)) {
+        outmsg_t pm = client_chat_out(c->id, cc, FRAME_PM, text, len);
+        /* a remote PM is acknowledged once its link takes it; the owning node answers if there's no such
+           user, but one lost with the link (counted in /stats) is not reported */
+        if (!p) { send_to(w, owner, tslot, tid, &pm); client_notice(w, slot, "[PM sent]\n"); }
+        else if (link_queue(p, LINK_TO, NULL, pm.bin, tid) == 0) client_notice(w, slot, "[PM forwarded]\n");
+        else client_notice(w, slot, "That user's node is unreachable.\n");
+        out_release(&pm);
+        log_event("PM from=%" PRId64 " to=%" PRId64 " text=%.*s", c->id, tid, (int)len, text);
+    } else { client_notice(w, slot, "User not found.\n"); }
+}
+
+/* move a client between rooms, telling both rooms */
+static void room_move(worker_t *w, int slot, int room) {
+    client_t *c = client_at(w, slot);
+    client_cold_t *cc = cold_at(w, slot);
+    if (cc->room == room) { client_notice(w, slot, "Already in that room.\n"); return; }
+    int old = cc->room;
+    xfer_cut_all(w, slot);
+    room_pin(old); /* keep its id and name until the room has been told */
+    room_exit(w, slot);
+    if (room_enter(w, slot, room) < 0) {
+        room_enter(w, slot, old);
+        room_unpin(old);
+        client_notice(w, slot, "Could not join.\n");
+        return;
+    }
+
+    outmsg_t o = notice_fmt("[Server] %s (ID:%" PRId64 ") left #%s.\n", cc->name, c->id, room_names[old]);
+    broadcast_room(w, old, &o, -1);
+    out_release(&o);
+    room_unpin(old);
+    o = notice_fmt("[Server] %s (ID:%" PRId64 ") joined #%s.\n", cc->name, c->id, room_names[room]);
+    broadcast_room(w, room, &o, -1);
+    out_release(&o);
+    history_replay(w, slot, room, history_len);
+    log_event("JOIN id=%" PRId64 " room=%s", c->id, room_names[room]);
+}
+
+/* /join: room names get the same sanitizing as nicknames */
+static void cmd_join(worker_t *w, int slot, const char *name, size_t len) {
+    if (len == 0) { client_notice(w, slot, "Usage: /join <room>\n"); return; }
+    char room[NAME_LEN];
+    size_t nl = len < NAME_LEN - 1 ? len : NAME_LEN - 1;
+    for (size_t i = 0; i < nl; ++i) room[i] = (unsigned char)name[i] < 0x20 ? '_' : name[i];
+    room[nl] = '\0';
+    int id = room_lookup(w, room, 0);
+    if (id < 0) {
+        if (room_quota_take(w, client_at(w, slot)->fd) < 0) { client_notice(w, slot, "You are creating rooms too fast.\n"); return; }
+        if ((id = room_lookup(w, room, 1)) < 0) { client_notice(w, slot, "Too many rooms.\n"); return; }
+    }
+    room_move(w, slot, id);
+    room_unpin(id);
+}
+
+/* normal message -> the sender's room */
+static void cmd_chat(worker_t *w, int slot, const char *text, size_t len) {
+    client_t *c = client_at(w, slot);
+    client_cold_t *cc = cold_at(w, slot);
+    outmsg_t out = client_chat_out(c->id, cc, FRAME_MSG, text, len);
+    broadcast_room(w, cc->room, &out, c->fd);
+    history_push(cc->room, &out);
+    journal_append(cc->room, &out);
+    out_release(&out);
+    log_event("MSG id=%" PRId64 " name=%s room=%s text=%.*s", c->id, cc->name, room_names[cc->room], (int)len, text);
+}
+
+/* one piece of a transfer -> the sender's room, relayed now rather than once the whole thing is in */
+static void cmd_chunk(worker_t *w, int slot, unsigned stream, int flags, const char *p, size_t len) {
+    client_t *c = client_at(w, slot);
+    client_cold_t *cc = cold_at(w, slot);
+    outmsg_t out = client_chat_out(c->id, cc, FRAME_CHUNK, p, len);
+    chunk_mark(&out, flags & FRAME_F_MORE, stream);
+    broadcast_room(w, cc->room, &out, c->fd);
+    out_release(&out);
+    log_event("CHUNK id=%" PRId64 " room=%s stream=%u len=%zu%s", c->id, room_names[cc->room], stream, len,
+              flags & FRAME_F_MORE ? "" : " last");
+}
+
+/* end a transfer for the sender's room before it's complete; whatever else of it comes in is dropped */
+static void xfer_cut(worker_t *w, int slot, int i) {
+    client_t *c = client_at(w, slot);
+    client_cold_t *cc = cold_at(w, slot);
+    if (cc->xfer_cut & 1u << i) return;
+    cc->xfer_cut |= (uint8_t)(1u << i);
+    outmsg_t a = chunk_abort(c->id, cc->xfer[i]);
+    broadcast_room(w, cc->room, &a, c->fd);
+    out_release(&a);
+}
+
+/* the sender leaves its room or the server: nobody there will ever see the end of what it had open */
+static void xfer_cut_all(worker_t *w, int slot) {
+    for (int i = 0; i < cold_at(w, slot)->nxfer; ++i) xfer_cut(w, slot, i);
+}
+
+/* Token buckets in their GCRA form: rather than a token count refilled by a timer, each bucket keeps the
+   time it will be full again (tat). A message costing c ns of refill fits while tat + c stays within one
+   second of now, so refill is just the clock moving on and nothing runs between messages. */
+static uint64_t bucket_next(uint64_t tat, uint64_t now, uint64_t cost) {
+    if (cost > 1000000000ull) cost = 1000000000ull; /* one message bigger than the bucket fits when it's full */
+    uint64_t t = tat > now ? tat : now;
+    return t + cost > now + 1000000000ull ? 0 : t + cost;
+}
+
+/* charge one n-byte message to the client's buckets and the global one; -1 (after one notice) when
+   over a limit. Runs before any parsing or fan-out. */
+static int client_admit(worker_t *w, int slot, size_t n) {
+    if (!rate_msgs && !rate_bytes && !rate_global) return 0;
+    client_cold_t *cc = cold_at(w, slot);
+    uint64_t now = now_ns(), tm = cc->tat_msgs, tb = cc->tat_bytes;
+    int ok = 1;
+    if (rate_msgs && !(tm = bucket_next(tm, now, 1000000000ull / rate_msgs))) ok = 0;
+    if (ok && rate_bytes && !(tb = bucket_next(tb, now, (uint64_t)n * 1000000000ull / rate_bytes))) ok = 0;
+    if (ok && rate_global) {
+        uint64_t g = atomic_load_explicit(&global_tat, memory_order_relaxed), ng;
+        do {
+            if (!(ng = bucket_next(g, now, 1000000000ull / rate_global))) { ok = 0; break; }
+        } while (!atomic_compare_exchange_weak_explicit(&global_tat, &g, ng, memory_order_relaxed, memory_order_relaxed));
+    }
+    if (!ok) {
+        atomic_fetch_add_explicit(&stat_rate_drops, 1, memory_order_relaxed);
+        if (!cc->limited) client_notice(w, slot, "[Server] Rate limit exceeded, message dropped.\n");
+        cc->limited = 1;
+        return -1;
+    }
+    cc->tat_msgs = tm;
+    cc->tat_bytes = tb;
+    cc->limited = 0;
+    return 0;
+}
+
+/* handle one complete line (terminator already stripped, NUL-terminated); returns -1 when the client should be closed */
+static int client_input(worker_t *w, int slot, char *buf, size_t n) {
+    stat_add(w, ST_MSGS_IN, 1);
+    while (n > 0 && buf[n-1] == '\r') buf[--n] = '\0';
+    if (n == 0) return 0;
+
+    if (strncmp(buf, "/quit", 5) == 0) return -1;
+    if (strncmp(buf, "/pong", 5) == 0) return 0;
+    if (client_admit(w, slot, n) < 0) return 0;
+
+    if (buf[0] == '/') {
+
+        if (strncmp(buf, "/name ", 6) == 0) { cmd_name(w, slot, buf + 6, n - 6); return 0; }
+
+        if (strncmp(buf, "/list", 5) == 0) { list_users(w, slot); return 0; }
+
+        if (strncmp(buf, "/stats", 6) == 0) { send_stats(w, slot); return 0; }
+
+        if (strncmp(buf, "/join ", 6) == 0) { cmd_join(w, slot, buf + 6, n - 6); return 0; }
+
+        if (strncmp(buf, "/leave", 6) == 0) { room_move(w, slot, LOBBY); return 0; }
+
+        if (strncmp(buf, "/history", 8) == 0) {
+            int hn = n > 8 ? atoi(buf + 8) : history_len;
+            history_replay(w, slot, cold_at(w, slot)->room, hn);
+            return 0;
+        }
+
+        if (strncmp(buf, "/msg ", 5) == 0) {
+            char *p = buf + 5;
+            int64_t tid = atoll(p);
+            while (*p && *p != ' ') p++;
+            if (*p == ' ') p++;
+            cmd_msg(w, slot, tid, p, (size_t)(buf + n - p));
+            return 0;
+        }
+
+        client_notice(w, slot, "Unknown command.\n");
+        return 0;
+    }
+
+    cmd_chat(w, slot, buf, n);
+    return 0;
+}
+
+/* one piece of a transfer from this client: opens the transfer if it's new and closes it on the last
+   piece. A piece the rate limiter refuses aborts the whole transfer, since relaying the rest would leave
+   a hole nobody can see. -1 when the client should be closed. */
+static int client_chunk(worker_t *w, int slot, unsigned stream, int more, const char *p, size_t len) {
+    client_cold_t *cc = cold_at(w, slot);
+    int i = 0;
+    while (i < cc->nxfer && cc->xfer[i] != stream) i++;
+    if (i == cc->nxfer) {
+        if (cc->nxfer == CHUNK_STREAMS) { client_notice_flush(w, slot, "Too many open transfers.\n"); return -1; }
+        cc->xfer[cc->nxfer++] = (uint16_t)stream;
+        cc->xfer_cut &= (uint8_t)~(1u << i);
+    }
+    if (!(cc->xfer_cut & 1u << i)) {
+        if (client_admit(w, slot, len) < 0) xfer_cut(w, slot, i);
+        else cmd_chunk(w, slot, stream, more ? FRAME_F_MORE : 0, p, len);
+    }
+    if (!more) {
+        int last = --cc->nxfer; /* swap-remove, cut bit included */
+        uint8_t bit = cc->xfer_cut >> last & 1;
+        cc->xfer[i] = cc->xfer[last];
+        cc->xfer_cut = (uint8_t)((cc->xfer_cut & ~(1u << i) & ~(1u << last)) | bit << i);
+    }
+    return 0;
+}
+
+/* text line too long for the input buffer: each buffer's worth goes out as a piece of stream 0 */
+static int client_line_chunk(worker_t *w, int slot, char *buf, size_t n, int more) {
+    stat_add(w, ST_MSGS_IN, 1);
+    while (!more && n > 0 && buf[n-1] == '\r') n--;
+    return client_chunk(w, slot, 0, more, buf, n);
+}
+
+/* handle one binary frame (stream: FRAME_CHUNK's header field); returns -1 when the client should be closed */
+static int client_frame(worker_t *w, int slot, int type, int flags, unsigned stream, int64_t id, const char *p, size_t len) {
+    stat_add(w, ST_MSGS_IN, 1);
+    client_t *c = client_at(w, slot);
+    client_cold_t *cc = cold_at(w, slot);
+    if (type == FRAME_QUIT) return -1;
+    if (type == FRAME_CHUNK) return client_chunk(w, slot, stream, flags & FRAME_F_MORE, p, len); /* admits per transfer */
+    if (type != FRAME_HELLO && type != FRAME_PONG && client_admit(w, slot, len) < 0) return 0;
+    switch (type) {
+    case FRAME_HELLO: {
+        if (cc->greeted || len != strlen(FRAME_MAGIC) || memcmp(p, FRAME_MAGIC, len) != 0) return -1;
+        cc->greeted = 1;
+        msgbuf_t *m = frame_new(FRAME_HELLO, c->id, NULL, cc->name, strlen(cc->name));
+        if (m && (flags & FRAME_F_DEFLATE) && zip_min && !c->deflate) {
+            c->deflate = 1;
+            atomic_fetch_add(&zip_clients, 1);
+            m->data[1] = FRAME_F_DEFLATE;
+        }
+        client_send(w, slot, m);
+        msg_unref(m);
+        history_replay(w, slot, cc->room, history_len);
+        return 0;
+    }
+    case FRAME_MSG:    if (len) cmd_chat(w, slot, p, len); return 0;
+    case FRAME_PM:     cmd_msg(w, slot, id, p, len); return 0;
+    case FRAME_NAME:   cmd_name(w, slot, p, len); return 0;
+    case FRAME_LIST:   list_users(w, slot); return 0;
+    case FRAME_STATS:  send_stats(w, slot); return 0;
+    case FRAME_JOIN:   cmd_join(w, slot, p, len); return 0;
+    case FRAME_LEAVE:  room_move(w, slot, LOBBY); return 0;
+    case FRAME_HISTORY: history_replay(w, slot, cold_at(w, slot)->room, (int)id); return 0;
+    case FRAME_PONG:   return 0;
+    default:           client_notice(w, slot, "Unknown command.\n"); return 0;
+    }
+}
+
+/* split buffered input into frames; an incomplete frame stays buffered. Oversized frames are a protocol error. */
+static int client_frames(worker_t *w, int slot) {
+    client_cold_t *cc = cold_at(w, slot);
+    const unsigned char *p = (const unsigned char *)cc->in;
+    size_t off = 0;
+    while (cc->in_len - off >= FRAME_HDR) {
+        uint32_t len = get_be32(p + off + 4);
+        if (len > BUF_SIZE - 1 - FRAME_HDR) { client_notice_flush(w, slot, "Frame too large.\n"); return -1; }
+        if (cc->in_len - off < FRAME_HDR + len) break;
+        if (client_frame(w, slot, p[off], p[off + 1], (unsigned)p[off + 2] << 8 | p[off + 3], (int64_t)get_be64(p + off + 8),
+                         cc->in + off + FRAME_HDR, len) < 0) return -1;
+        off += FRAME_HDR + len;
+    }
+    if (off && off < cc->in_len) memmove(cc->in, cc->in + off, cc->in_len - off);
+    cc->in_len -= off;
+    return 0;
+}
+
+/* split buffered input into lines and handle each; the trailing partial line stays buffered.
+   A line that fills the whole buffer without a newline is streamed in pieces, unless it's a command,
+   which is handled as it stands. */
+static int client_lines(worker_t *w, int slot, size_t scanned) {
+    client_cold_t *cc = cold_at(w, slot);
+    char *start = cc->in, *end = cc->in + cc->in_len;
+    char *nl = memchr(cc->in + scanned, '\n', cc->in_len - scanned);
+    while (nl) {
+        *nl = '\0';
+        if (cc->streaming) {
+            cc->streaming = 0;
+            if (client_line_chunk(w, slot, start, (size_t)(nl - start), 0) < 0) return -1;
+        } else if (client_input(w, slot, start, (size_t)(nl - start)) < 0) return -1;
+        start = nl + 1;
+        nl = memchr(start, '\n', (size_t)(end - start));
+    }
+    size_t rest = (size_t)(end - start);
+    if (rest == BUF_SIZE - 1) {
+        cc->in[BUF_SIZE - 1] = '\0';
+        if (cc->streaming || cc->in[0] != '/') {
+            cc->streaming = 1;
+            if (client_line_chunk(w, slot, cc->in, rest, 1) < 0) return -1;
+        } else if (client_input(w, slot, cc->in, rest) < 0) return -1;
+        rest = 0;
+    }
+    if (rest && start != cc->in) memmove(cc->in, start, rest);
+    cc->in_len = rest;
+    return 0;
+}
+
+/* n fresh bytes sit at the end of the input buffer: handle every line or frame they complete */
+static int client_consume(worker_t *w, int slot, size_t n) {
+    client_t *c = client_at(w, slot);
+    client_cold_t *cc = cold_at(w, slot);
+    size_t scanned = cc->in_len;
+    cc->in_len += n;
+    cc->last_rx = w->tick;
+    stat_add(w, ST_BYTES_IN, (uint64_t)n);
+    if (c->proto == PROTO_UNKNOWN) c->proto = cc->in[0] == '\0' ? PROTO_BINARY : PROTO_TEXT;
+    PROF_BEGIN(span);
+    int ret = c->proto == PROTO_BINARY ? client_frames(w, slot) : client_lines(w, slot, scanned);
+    PROF_END(PS_PARSE, span);
+    return ret;
+}
+
+/* edge-triggered: read until EAGAIN, handling every complete line or frame each read brings in */
+static void client_readable(worker_t *w, int slot) {
+    client_t *c = client_at(w, slot);
+    client_cold_t *cc = cold_at(w, slot);
+    if (!cc->in && !(cc->in = pool_get(&w->in_pool))) { client_close(w, slot); return; }
+    while (c->alive) {
+        PROF_BEGIN(span);
+        ssize_t n = recv(c->fd, cc->in + cc->in_len, BUF_SIZE - 1 - cc->in_len, 0);
+        PROF_END(PS_RECV, span);
+        PROF_SYS(PC_RECV);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) { client_in_idle(w, cc); return; }
+        }
+        if (n <= 0 || client_consume(w, slot, (size_t)n) < 0) { client_close(w, slot); return; }
+    }
+}
+
+/* seat a new connection in a slot and the lobby; -1 (connection already closed) when there's no room */
+static int client_accepted(worker_t *w, int fd) {
+    int slot = add_client(w, fd, 0, NULL, tls_ctx != NULL);
+    if (slot < 0) { if (!tls_ctx) send_str(fd, "Server full.\n"); close(fd); return -1; }
+    stat_add(w, ST_ACCEPTS, 1);
+    if (tls_ctx) { /* seated once the handshake is done, so no broadcast queues up behind it */
+        client_cold_t *cc = cold_at(w, slot);
+        if (!(cc->tls = SSL_new(tls_ctx)) || !SSL_set_fd(cc->tls, fd)) { remove_client(w, slot); return -1; }
+        SSL_set_accept_state(cc->tls);
+        return slot;
+    }
+    if (room_enter(w, slot, LOBBY) < 0) { remove_client(w, slot); return -1; }
+    return slot;
+}
+
+static void tls_step(worker_t *w, int slot);
+
+/* edge-triggered: drain the whole accept queue each wakeup */
+static void accept_clients(worker_t *w) {
+    while (1) {
+        PROF_SYS(PC_ACCEPT);
+        int client_fd = accept4(w->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) perror("accept");
+            return;
+        }
+
+        int slot = client_accepted(w, client_fd);
+        if (slot < 0) continue;
+        struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.u64 = (uint64_t)slot };
+        if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) < 0) {
+            perror("epoll_ctl");
+            remove_client(w, slot);
+            continue;
+        }
+        if (client_at(w, slot)->handshake) tls_step(w, slot);
+        else client_open(w, slot);
+    }
+}
+
+/* drain the inbox: take the whole list under the lock, deliver outside it */
+static void process_mail(worker_t *w) {
+    uint64_t cnt;
+    PROF_BEGIN(span);
+    PROF_SYS(PC_EVENTFD);
+    if (read(w->wake_fd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN) perror("eventfd read");
+
+    pthread_mutex_lock(&w->inbox_mtx);
+    mail_t *m = w->inbox_head;
+    w->inbox_head = w->inbox_tail = NULL;
+    pthread_mutex_unlock(&w->inbox_mtx);
+
+    while (m) {
+        mail_t *next = m->next;
+        if (m->kind == MAIL_BROADCAST) broadcast_local(w, &m->msg, m->except_fd);
+        else if (m->kind == MAIL_ROOM) {
+            /* the room may have emptied and been handed to another name since this was posted */
+            if ((unsigned)m->id == atomic_load(&room_gen[m->slot])) broadcast_room_local(w, m->slot, &m->msg, m->except_fd);
+        }
+        else send_to(w, w->index, m->slot, m->id, &m->msg);
+        out_release(&m->msg);
+        free(m);
+        m = next;
+    }
+    PROF_END(PS_MAIL, span);
+}
+
+/* SLOW_DISCONNECT: throw away the backlog, try to say why, then close */
+static void client_evict(worker_t *w, int slot) {
+    client_t *c = client_at(w, slot);
+    for (uint32_t i = 0; i < c->out_count; ++i) count_drop(c->outq[(c->out_head + i) & (c->out_cap - 1)]->len);
+    atomic_fetch_add_explicit(&stat_evictions, 1, memory_order_relaxed);
+    log_event("EVICT id=%" PRId64 " pending=%zu", c->id, c->out_bytes);
+    client_discard_output(w, c);
+    const char *notice = "[Server] Disconnected: too far behind on output.\n";
+    if (!c->handshake && send(c->fd, notice, strlen(notice), MSG_NOSIGNAL | MSG_DONTWAIT) < 0) { /* best effort */ }
+    client_close(w, slot);
+}
+
+static void uring_send(worker_t *w, int slot);
+
+/* write out everything queued this iteration; a close here may queue more, so pop until empty */
+static void flush_clients(worker_t *w) {
+    while (w->nflush > 0) {
+        int slot = w->flush_list[--w->nflush];
+        client_t *c = client_at(w, slot);
+        c->queued = 0;
+        if (!c->alive) continue;
+        if (c->evict) { client_evict(w, slot); continue; }
+        if (w->ring) uring_send(w, slot);
+        else if (client_flush(w, c) < 0) client_close(w, slot);
+    }
+}
+
+/* io_uring backend (--backend uring): multishot accept, multishot recv into a provided buffer ring,
+ * and sends prepared during flush_clients() that go to the kernel with the next wait, one
+ * io_uring_enter per loop iteration. Raw syscalls; no liburing. */
+enum { UD_SEND, UD_ACCEPT, UD_WAKE, UD_RECV, UD_TIMER, UD_CANCEL, UD_TLS }; /* low 3 bits of user_data; sends carry their uring_tx pointer */
+
+/* one client's send in flight; holds the references of the messages it covers */
+typedef struct uring_tx {
+    int slot;
+    int64_t id;
+    int n, first;               /* buffers in the send, first one not fully written */
+    msgbuf_t *bufs[IOV_BATCH];
+    struct iovec iov[IOV_BATCH];
+    struct msghdr mh;
+} uring_tx_t;
+
+typedef struct uring {
+    int fd;
+    unsigned sq_entries;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned sq_local, sq_submitted; /* prepared / handed to the kernel */
+    struct io_uring_buf_ring *br;
+    unsigned short br_tail;
+    char *bufs;
+} uring_t;
+
+static int uring_enter(uring_t *r, unsigned wait) {
+    __atomic_store_n(r->sq_tail, r->sq_local, __ATOMIC_RELEASE);
+    unsigned n = r->sq_local - r->sq_submitted;
+    PROF_SYS(PC_WAIT);
+    int ret = (int)syscall(__NR_io_uring_enter, r->fd, n, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (ret > 0) r->sq_submitted += (unsigned)ret;
+    return ret;
+}
+
+/* next free SQE, zeroed; submits early only when the queue is full */
+static struct io_uring_sqe *uring_sqe(uring_t *r) {
+    if (r->sq_local - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries && uring_enter(r, 0) < 0) return NULL;
+    if (r->sq_local - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries) return NULL;
+    unsigned idx = r->sq_local++ & *r->sq_mask;
+    r->sq_array[idx] = idx;
+    memset(&r->sqes[idx], 0, sizeof(r->sqes[idx]));
+    return &r->sqes[idx];
+}
+
+static void uring_recycle(uring_t *r, unsigned bid) {
+    struct io_uring_buf *b = &r->br->bufs[r->br_tail & (URING_BUFS - 1)];
+    b->addr = (uint64_t)(uintptr_t)(r->bufs + (size_t)bid * BUF_SIZE);
+    b->len = BUF_SIZE;
+    b->bid = (unsigned short)bid;
+    __atomic_store_n(&r->br->tail, ++r->br_tail, __ATOMIC_RELEASE);
+}
+
+/* NULL when the kernel lacks io_uring or the features used here */
+static uring_t *uring_init(void) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = URING_ENTRIES * 4;
+    int fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (fd < 0) { perror("io_uring_setup"); return NULL; }
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) { fprintf(stderr, "io_uring: kernel too old\n"); close(fd); return NULL; }
+
+    size_t sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    size_t sz = sq_sz > cq_sz ? sq_sz : cq_sz;
+    char *ring = mmap(NULL, sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    struct io_uring_sqe *sqes = mmap(NULL, p.sq_entries * sizeof(*sqes), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    uring_t *r = calloc(1, sizeof(*r));
+    size_t br_sz = URING_BUFS * sizeof(struct io_uring_buf);
+    void *br = mmap(NULL, br_sz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    char *bufs = malloc((size_t)URING_BUFS * BUF_SIZE);
+    if (ring == MAP_FAILED || sqes == MAP_FAILED || br == MAP_FAILED || !r || !bufs) { perror("io_uring"); close(fd); return NULL; }
+
+    r->fd = fd;
+    r->sq_entries = p.sq_entries;
+    r->sq_head = (unsigned *)(ring + p.sq_off.head);
+    r->sq_tail = (unsigned *)(ring + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(ring + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(ring + p.sq_off.array);
+    r->cq_head = (unsigned *)(ring + p.cq_off.head);
+    r->cq_tail = (unsigned *)(ring + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(ring + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+    r->sqes = sqes;
+    r->br = br;
+    r->bufs = bufs;
+
+    struct io_uring_buf_reg reg = { .ring_addr = (uint64_t)(uintptr_t)br, .ring_entries = URING_BUFS, .bgid = 0 };
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) { perror("IORING_REGISTER_PBUF_RING"); close(fd); return NULL; }
+    for (unsigned i = 0; i < URING_BUFS; ++i) uring_recycle(r, i);
+    return r;
+}
+
+static void uring_arm_accept(worker_t *w) {
+    struct io_uring_sqe *sqe = uring_sqe(w->ring);
+    if (!sqe) return;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = w->listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = UD_ACCEPT;
+}
+
+/* multishot readiness on the wake eventfd or the tick timerfd */
+static void uring_arm_poll(worker_t *w, int fd, uint64_t tag) {
+    struct io_uring_sqe *sqe = uring_sqe(w->ring);
+    if (!sqe) return;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = tag;
+}
+
+/* recv and handshake completions name the slot and the low id bits, so one for a recycled slot is recognised */
+static uint64_t uring_client_ud(worker_t *w, int slot, uint64_t tag) {
+    return tag | (uint64_t)slot << 3 | (uint64_t)(uint32_t)client_at(w, slot)->id << 32;
+}
+
+/* cancel the request tagged ud; its completion and the cancel's own both still arrive */
+static void uring_cancel(worker_t *w, uint64_t ud) {
+    struct io_uring_sqe *sqe = uring_sqe(w->ring);
+    if (!sqe) return;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = ud;
+    sqe->user_data = UD_CANCEL;
+    w->cancels++;
+}
+
+/* multishot recv into the provided buffer ring */
+static void uring_arm_recv(worker_t *w, int slot) {
+    client_t *c = client_at(w, slot);
+    struct io_uring_sqe *sqe = uring_sqe(w->ring);
+    if (!sqe) { client_close(w, slot); return; }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = c->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = uring_client_ud(w, slot, UD_RECV);
+}
+
+/* one-shot readiness for the next step of a TLS handshake */
+static void uring_arm_tls(worker_t *w, int slot, unsigned events) {
+    struct io_uring_sqe *sqe = uring_sqe(w->ring);
+    if (!sqe) { remove_client(w, slot); return; }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = client_at(w, slot)->fd;
+    sqe->poll32_events = events;
+    sqe->user_data = uring_client_ud(w, slot, UD_TLS);
+}
+
+/* Run the handshake as far as the socket allows. OpenSSL (SSL_OP_ENABLE_KTLS) installs the session
+   keys in the kernel as they are negotiated, so once it finishes the fd is plain again to everything
+   else: reads and the gathered sendmsg see cleartext and the kernel does the records. A session that
+   did not get offloaded both ways is dropped rather than encrypted here. */
+static void tls_step(worker_t *w, int slot) {
+    client_t *c = client_at(w, slot);
+    client_cold_t *cc = cold_at(w, slot);
+    int r = SSL_accept(cc->tls);
+    if (r == 1) {
+        if (!BIO_get_ktls_send(SSL_get_wbio(cc->tls)) || !BIO_get_ktls_recv(SSL_get_rbio(cc->tls))) {
+            log_event("TLS id=%" PRId64 " %s %s: no kernel offload", c->id, SSL_get_version(cc->tls), SSL_get_cipher_name(cc->tls));
+            remove_client(w, slot);
+            return;
+        }
+        SSL_free(cc->tls);
+        cc->tls = NULL;
+        c->handshake = 0;
+        cc->last_rx = w->tick;
+        if (w->timer_fd >= 0) { wheel_del(w, slot); wheel_add(w, slot, client_deadline(c, cc, w->tick)); }
+        client_seat(w, slot);
+        if (room_enter(w, slot, LOBBY) < 0) { remove_client(w, slot); return; }
+        client_open(w, slot);
+        if (w->ring) uring_arm_recv(w, slot);
+        return;
+    }
+    int e = SSL_get_error(cc->tls, r);
+    if (e == SSL_ERROR_WANT_READ || e == SSL_ERROR_WANT_WRITE) {
+        if (w->ring) uring_arm_tls(w, slot, e == SSL_ERROR_WANT_READ ? POLLIN : POLLOUT);
+        return; /* epoll: edge-triggered EPOLLIN|EPOLLOUT brings it back */
+    }
+    char err[128];
+    ERR_error_string_n(ERR_get_error(), err, sizeof(err));
+    ERR_clear_error();
+    log_event("TLS id=%" PRId64 " handshake failed: %s", c->id, err);
+    remove_client(w, slot);
+}
+
+static void uring_submit_tx(worker_t *w, uring_tx_t *tx) {
+    client_t *c = client_at(w, tx->slot);
+    struct io_uring_sqe *sqe = uring_sqe(w->ring);
+    if (!sqe) { c->tx_busy = 0; return; } /* retried from the next flush */
+    tx->mh.msg_iov = tx->iov + tx->first;
+    tx->mh.msg_iovlen = (size_t)(tx->n - tx->first);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = c->fd;
+    sqe->addr = (uint64_t)(uintptr_t)&tx->mh;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uint64_t)(uintptr_t)tx;
+    c->tx_busy = 1;
+}
+
+/* move up to IOV_BATCH queued messages into the client's send and prepare it; bytes stay counted in
+   out_bytes until the kernel reports them written */
+static void uring_send(worker_t *w, int slot) {
+    client_t *c = client_at(w, slot);
+    client_cold_t *cc = cold_at(w, slot);
+    if (c->tx_busy || !c->out_count || c->handshake) return;
+    if (!cc->tx && !(cc->tx = pool_get(&w->tx_pool))) return;
+    uring_tx_t *tx = cc->tx;
+    tx->slot = slot;
+    tx->id = c->id;
+    tx->n = tx->first = 0;
+    memset(&tx->mh, 0, sizeof(tx->mh));
+    while (c->out_count && tx->n < IOV_BATCH) {
+        msgbuf_t *m = outq_pop(c);
+        tx->bufs[tx->n] = m;
+        tx->iov[tx->n].iov_base = m->data + c->out_off;
+        tx->iov[tx->n].iov_len = m->len - c->out_off;
+        tx->n++;
+        c->out_off = 0;
+    }
+    if (!c->out_count) outq_release(w, c);
+    uring_submit_tx(w, tx);
+}
+
+static void uring_sent(worker_t *w, uring_tx_t *tx, int res) {
+    client_t *c = client_at(w, tx->slot);
+    int live = c->alive && c->id == tx->id && cold_at(w, tx->slot)->tx == tx;
+    size_t left = res > 0 ? (size_t)res : 0;
+    if (live && res > 0) {
+        c->out_bytes -= left;
+        stat_add(w, ST_BYTES_OUT, left);
+        stat_add(w, ST_OUT_QUEUED, -(uint64_t)left);
+    }
+    while (tx->first < tx->n && left >= tx->iov[tx->first].iov_len) {
+        left -= tx->iov[tx->first].iov_len;
+        msg_unref(tx->bufs[tx->first++]);
+    }
+    if (tx->first < tx->n) {
+        tx->iov[tx->first].iov_base = (char *)tx->iov[tx->first].iov_base + left;
+        tx->iov[tx->first].iov_len -= left;
+    }
+    int retry = res > 0 || res == -EAGAIN || res == -EINTR;
+    if (live && retry && tx->first < tx->n) { uring_submit_tx(w, tx); return; } /* short write: send the rest */
+
+    while (tx->first < tx->n) msg_unref(tx->bufs[tx->first++]);
+    if (!live) { pool_put(&w->tx_pool, tx); return; } /* the client went away while this was in flight */
+    c->tx_busy = 0;
+    if (!retry) { client_close(w, tx->slot); return; }
+    if (c->dropping && c->out_bytes <= out_low) c->dropping = 0;
+    if (c->out_count) { mark_dirty(w, tx->slot); return; }
+    pool_put(&w->tx_pool, tx); /* drained: the next send borrows one again */
+    cold_at(w, tx->slot)->tx = NULL;
+}
+
+/* copy a provided buffer into the client's input buffer, handing each piece to the parser */
+static void uring_received(worker_t *w, int slot, const char *p, size_t n) {
+    client_t *c = client_at(w, slot);
+    client_cold_t *cc = cold_at(w, slot);
+    if (!cc->in && !(cc->in = pool_get(&w->in_pool))) { client_close(w, slot); return; }
+    while (n > 0 && c->alive) {
+        size_t room = BUF_SIZE - 1 - cc->in_len, k = n < room ? n : room;
+        memcpy(cc->in + cc->in_len, p, k);
+        if (client_consume(w, slot, k) < 0) { client_close(w, slot); return; }
+        p += k;
+        n -= k;
+    }
+    if (c->alive) client_in_idle(w, cc);
+}
+
+static void uring_complete(worker_t *w, uint64_t ud, int res, unsigned flags) {
+    uring_t *r = w->ring;
+    switch (ud & 7) {
+    case UD_SEND:
+        uring_sent(w, (uring_tx_t *)(uintptr_t)ud, res);
+        break;
+    case UD_ACCEPT:
+        if (w->stopping) { if (res >= 0) close(res); break; } /* raced the cancellation; the client retries */
+        if (res >= 0) {
+            int slot = client_accepted(w, res);
+            if (slot >= 0 && client_at(w, slot)->handshake) tls_step(w, slot);
+            else if (slot >= 0) { client_open(w, slot); uring_arm_recv(w, slot); }
+        } else if (res != -EAGAIN && res != -EINTR && res != -ECONNABORTED) {
+            errno = -res;
+            perror("accept");
+        }
+        if (!(flags & IORING_CQE_F_MORE)) uring_arm_accept(w);
+        break;
+    case UD_WAKE:
+        process_mail(w);
+        if (!(flags & IORING_CQE_F_MORE)) uring_arm_poll(w, w->wake_fd, UD_WAKE);
+        break;
+    case UD_CANCEL:
+        w->cancels--;
+        break;
+    case UD_TLS: {
+        int slot = (int)((ud >> 3) & 0x1fffffff);
+        client_t *c = client_at(w, slot);
+        if (w->stopping || !c->alive || !c->handshake || (uint32_t)c->id != (uint32_t)(ud >> 32)) break;
+        tls_step(w, slot);
+        break;
+    }
+    case UD_TIMER:
+        worker_ticks(w);
+        if (!(flags & IORING_CQE_F_MORE)) uring_arm_poll(w, w->timer_fd, UD_TIMER);
+        break;
+    case UD_RECV: {
+        int slot = (int)((ud >> 3) & 0x1fffffff);
+        client_t *c = client_at(w, slot);
+        int live = c->alive && (uint32_t)c->id == (uint32_t)(ud >> 32);
+        if (flags & IORING_CQE_F_BUFFER) {
+            unsigned bid = flags >> IORING_CQE_BUFFER_SHIFT;
+            if (live && res > 0) uring_received(w, slot, r->bufs + (size_t)bid * BUF_SIZE, (size_t)res);
+            uring_recycle(r, bid);
+        }
+        if (!live || !c->alive || (uint32_t)c->id != (uint32_t)(ud >> 32)) break;
+        if (w->stopping && atomic_load(&stop_mode) == STOP_HANDOFF) break; /* cancelled: the successor reads it */
+        if (res <= 0 && res != -ENOBUFS) client_close(w, slot);
+        else if (!(flags & IORING_CQE_F_MORE)) uring_arm_recv(w, slot); /* out of buffers, or the kernel ended it */
+        break;
+    }
+    }
+}
+
+/* first look at a stop: take no new connections (they wait in the backlog, which a successor inherits);
+   for a shutdown tell everyone, for a handoff stop reading so unread input stays in the sockets */
+static void worker_quiesce(worker_t *w) {
+    int mode = atomic_load(&stop_mode);
+    w->stopping = 1;
+    if (w->ring) uring_cancel(w, UD_ACCEPT);
+    else epoll_ctl(w->epoll_fd, EPOLL_CTL_DEL, w->listen_fd, NULL);
+    for (int i = 0; i < w->nlive; ++i) {
+        int slot = w->live[i];
+        if (mode == STOP_SHUTDOWN) client_notice(w, slot, "[Server] Shutting down.\n");
+        else if (w->ring) uring_cancel(w, uring_client_ud(w, slot, UD_RECV));
+    }
+    flush_clients(w);
+}
+
+/* 1 once this worker's output has drained (or the deadline passed) and its loop may end */
+static int worker_stopped(worker_t *w) {
+    if (!w->stopping) worker_quiesce(w);
+    if (now_ns() < atomic_load(&drain_deadline)) {
+        if (w->cancels) return 0;
+        for (int i = 0; i < w->nlive; ++i) {
+            client_t *c = client_at(w, w->live[i]);
+            if (c->out_count || c->tx_busy) return 0;
+        }
+    }
+    if (atomic_load(&stop_mode) == STOP_SHUTDOWN)
+        while (w->nlive) remove_client(w, w->live[0]);
+    return 1;
+}
+
+static void uring_loop(worker_t *w) {
+    uring_t *r = w->ring;
+    uring_arm_accept(w);
+    uring_arm_poll(w, w->wake_fd, UD_WAKE);
+    if (w->timer_fd >= 0) uring_arm_poll(w, w->timer_fd, UD_TIMER);
+    while (1) {
+        rcu_offline(w);
+        int ret = uring_enter(r, 1);
+        rcu_quiescent(w);
+        if (atomic_load(&rcu_pending) && clients_trylock() == 0) {
+            rcu_reclaim();
+            clients_unlock();
+        }
+        if (ret < 0 && errno != EINTR && errno != EBUSY) { perror("io_uring_enter"); break; }
+        unsigned head = *r->cq_head, tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) { /* one snapshot per iteration, so sends go out between batches */
+            struct io_uring_cqe cqe = r->cqes[head & *r->cq_mask];
+            __atomic_store_n(r->cq_head, ++head, __ATOMIC_RELEASE);
+            uring_complete(w, cqe.user_data, cqe.res, cqe.flags);
+        }
+        flush_clients(w);
+        if (atomic_load(&stop_mode) != RUN && worker_stopped(w)) break;
+    }
+}
+
+/* listening socket for one worker; SO_REUSEPORT lets the kernel spread accepts across workers.
+   Per-connection options are set once here: accepted sockets inherit TCP_NODELAY and the buffer sizes
+   from the listener (set before listen() so the receive window scale is right from the SYN-ACK), and
+   accept4() makes them nonblocking, so a new connection costs no setup syscalls. */
+static int open_listener(void) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) { perror("socket"); exit(1); }
+
+    int opt = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) { perror("SO_REUSEPORT"); exit(1); }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt)); /* output is already coalesced per flush */
+    if (sock_sndbuf > 0 && setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sock_sndbuf, sizeof(sock_sndbuf)) < 0) perror("SO_SNDBUF");
+    if (sock_rcvbuf > 0 && setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &sock_rcvbuf, sizeof(sock_rcvbuf)) < 0) perror("SO_RCVBUF");
+    if (defer_accept > 0 && setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer_accept, sizeof(defer_accept)) < 0) perror("TCP_DEFER_ACCEPT");
+
+    struct sockaddr_in serv = {0};
+    serv.sin_family = AF_INET;
+    serv.sin_addr.s_addr = INADDR_ANY;
+    serv.sin_port = htons((uint16_t)listen_port);
+
+    if (bind(fd, (struct sockaddr *)&serv, sizeof(serv)) < 0) { perror("bind"); exit(1); }
+    if (listen(fd, listen_backlog) < 0) { perror("listen"); exit(1); }
+    return fd;
+}
+
+static int backend_uring = 0; /* --backend uring */
+
+/* --tls-cert: every client connection is TLS. TLS 1.2 with AES-GCM, the protocol and ciphers whose
+   records OpenSSL hands to the kernel in both directions (it cannot yet offload TLS 1.3 receive). */
+static void tls_init(void) {
+    int probe = socket(AF_INET, SOCK_STREAM, 0);
+    if (probe >= 0 && setsockopt(probe, IPPROTO_TCP, TCP_ULP, "tls", sizeof("tls")) < 0 && errno == ENOENT) {
+        fprintf(stderr, "TLS: kernel TLS is unavailable (modprobe tls)\n");
+        exit(1);
+    }
+    if (probe >= 0) close(probe); /* ENOTCONN: the ULP exists, it just wants an established socket */
+
+    tls_ctx = SSL_CTX_new(TLS_server_method());
+    if (!tls_ctx) { ERR_print_errors_fp(stderr); exit(1); }
+    SSL_CTX_set_min_proto_version(tls_ctx, TLS1_2_VERSION);
+    SSL_CTX_set_max_proto_version(tls_ctx, TLS1_2_VERSION);
+    SSL_CTX_set_options(tls_ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION | SSL_OP_NO_COMPRESSION);
+    SSL_CTX_set_session_cache_mode(tls_ctx, SSL_SESS_CACHE_OFF);
+    if (!SSL_CTX_set_cipher_list(tls_ctx, "ECDHE+AESGCM") ||
+        SSL_CTX_use_certificate_chain_file(tls_ctx, tls_cert) != 1 ||
+        SSL_CTX_use_PrivateKey_file(tls_ctx, tls_key ? tls_key : tls_cert, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(tls_ctx) != 1) {
+        ERR_print_errors_fp(stderr);
+        exit(1);
+    }
+    signal(SIGPIPE, SIG_IGN); /* OpenSSL writes the handshake with plain write(2) */
+}
+
+static void worker_init(worker_t *w, int index) {
+    w->index = index;
+    w->in_pool.size = BUF_SIZE;
+    w->outq_pool.size = OUTQ_MIN * sizeof(msgbuf_t *);
+    w->tx_pool.size = sizeof(uring_tx_t);
+    if (worker_grow(w) < 0) exit(1);
+    w->listen_fd = index < ninherited ? inherited_listen[index] : open_listener();
+    w->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (w->wake_fd < 0) { perror("eventfd"); exit(1); }
+    pthread_mutex_init(&w->inbox_mtx, NULL);
+    for (int i = 0; i < WHEEL_LEVELS * WHEEL_SIZE; ++i) w->wheel[i] = -1;
+    w->timer_fd = -1;
+    if (idle_ticks || ping_ticks || tls_ctx) {
+        struct itimerspec its = { .it_interval = { 0, TICK_MS * 1000000L }, .it_value = { 0, TICK_MS * 1000000L } };
+        w->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (w->timer_fd < 0 || timerfd_settime(w->timer_fd, 0, &its, NULL) < 0) { perror("timerfd"); exit(1); }
+    }
+
+    if (backend_uring) {
+        if ((w->ring = uring_init())) return;
+        fprintf(stderr, "worker %d: io_uring unavailable, using epoll\n", index);
+    }
+    w->epoll_fd = epoll_create1(0);
+    if (w->epoll_fd < 0) { perror("epoll_create1"); exit(1); }
+    struct epoll_event lev = { .events = EPOLLIN | EPOLLET, .data.u64 = LISTEN_TAG };
+    if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->listen_fd, &lev) < 0) { perror("epoll_ctl"); exit(1); }
+    struct epoll_event wev = { .events = EPOLLIN, .data.u64 = WAKE_TAG };
+    if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->wake_fd, &wev) < 0) { perror("epoll_ctl"); exit(1); }
+    struct epoll_event tev = { .events = EPOLLIN, .data.u64 = TIMER_TAG };
+    if (w->timer_fd >= 0 && epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->timer_fd, &tev) < 0) { perror("epoll_ctl"); exit(1); }
+}
+
+/* event loop */
+static void *worker_loop(void *arg) {
+    worker_t *w = arg;
+    if (w->ring) { uring_loop(w); zip_thread_end(); atomic_fetch_sub(&workers_running, 1); return NULL; }
+    struct epoll_event events[MAX_EVENTS];
+    while (1) {
+        rcu_offline(w);
+        PROF_SYS(PC_WAIT);
+        int n = epoll_wait(w->epoll_fd, events, MAX_EVENTS, -1);
+        rcu_quiescent(w);
+        if (atomic_load(&rcu_pending) && clients_trylock() == 0) {
+            rcu_reclaim();
+            clients_unlock();
+        }
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < n; ++i) {
+            if (events[i].data.u64 == LISTEN_TAG) { if (!w->stopping) accept_clients(w); continue; }
+            if (events[i].data.u64 == WAKE_TAG) { process_mail(w); continue; }
+            if (events[i].data.u64 == TIMER_TAG) { worker_ticks(w); continue; }
+            int slot = (int)events[i].data.u64;
+            client_t *c = client_at(w, slot);
+            if (!c->alive) continue;
+            if (c->evict) continue; /* flush_clients() closes it */
+            if ((events[i].events & EPOLLOUT) && client_flush(w, c) < 0) { client_close(w, slot); continue; }
+            if (w->stopping && atomic_load(&stop_mode) == STOP_HANDOFF) continue; /* input stays for the successor */
+            if (c->handshake) { tls_step(w, slot); continue; }
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) client_readable(w, slot);
+        }
+        flush_clients(w);
+        if (atomic_load(&stop_mode) != RUN && worker_stopped(w)) break;
+    }
+    zip_thread_end();
+    atomic_fetch_sub(&workers_running, 1);
+    return NULL;
+}
+
+/* SCM_RIGHTS over the handoff socket; at most MAX_WORKERS descriptors per message */
+static int send_fds(int sock, const void *buf, size_t len, const int *fds, int nfds) {
+    union { char buf[CMSG_SPACE(MAX_WORKERS * sizeof(int))]; struct cmsghdr align; } u;
+    struct iovec iov = { (void *)buf, len };
+    struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1 };
+    if (nfds) {
+        mh.msg_control = u.buf;
+        mh.msg_controllen = CMSG_SPACE((size_t)nfds * sizeof(int));
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN((size_t)nfds * sizeof(int));
+        memcpy(CMSG_DATA(cm), fds, (size_t)nfds * sizeof(int));
+    }
+    return sendmsg(sock, &mh, MSG_NOSIGNAL) == (ssize_t)len ? 0 : -1;
+}
+
+/* one message and the descriptors it carried; -1 on error or a truncated message */
+static ssize_t recv_fds(int sock, void *buf, size_t len, int *fds, int *nfds) {
+    union { char buf[CMSG_SPACE(MAX_WORKERS * sizeof(int))]; struct cmsghdr align; } u;
+    struct iovec iov = { buf, len };
+    struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = u.buf, .msg_controllen = sizeof(u.buf) };
+    ssize_t n = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC);
+    *nfds = 0;
+    if (n < 0) return -1;
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(&mh); cm; cm = CMSG_NXTHDR(&mh, cm)) {
+        if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS) continue;
+        int k = (int)((cm->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+        memcpy(fds + *nfds, CMSG_DATA(cm), (size_t)k * sizeof(int));
+        *nfds += k;
+    }
+    if (mh.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) { errno = EMSGSIZE; return -1; }
+    return n;
+}
+
+/* pass the listeners and every client to the successor on conn; runs after the workers have stopped */
+static int handoff_send(int conn) {
+    handoff_hdr_t h = { .magic = HANDOFF_MAGIC, .nlisten = (uint32_t)nworkers, .next_id = next_id };
+    int fds[MAX_WORKERS];
+    for (int i = 0; i < nworkers; ++i) {
+        fds[i] = workers[i].listen_fd;
+        h.nclients += (uint32_t)workers[i].nlive; /* a TLS connection still handshaking isn't listed; closed at exit */
+    }
+    if (send_fds(conn, &h, sizeof(h), fds, nworkers) < 0) return -1;
+
+    char *buf = malloc(HANDOFF_MSG);
+    if (!buf) return -1;
+    size_t len = 0;
+    int n = 0;
+    for (int wi = 0; wi < nworkers; ++wi) {
+        worker_t *w = &workers[wi];
+        for (int i = 0; i < w->nlive; ++i) {
+            client_t *c = client_at(w, w->live[i]);
+            client_cold_t *cc = cold_at(w, w->live[i]);
+            handoff_rec_t rec = { .id = c->id, .in_len = (uint32_t)cc->in_len, .proto = c->proto,
+                                  .deflate = c->deflate, .streaming = cc->streaming, .greeted = cc->greeted };
+            snprintf(rec.name, NAME_LEN, "%s", cc->name);
+            snprintf(rec.room, NAME_LEN, "%s", cc->room >= 0 ? room_names[cc->room] : room_names[LOBBY]);
+            if (len + sizeof(rec) + rec.in_len > HANDOFF_MSG) {
+                if (send_fds(conn, buf, len, fds, n) < 0) { free(buf); return -1; }
+                len = 0;
+                n = 0;
+            }
+            memcpy(buf + len, &rec, sizeof(rec));
+            if (rec.in_len) memcpy(buf + len + sizeof(rec), cc->in, rec.in_len);
+            len += sizeof(rec) + rec.in_len;
+            fds[n++] = c->fd;
+            if (n == HANDOFF_BATCH) {
+                if (send_fds(conn, buf, len, fds, n) < 0) { free(buf); return -1; }
+                len = 0;
+                n = 0;
+            }
+        }
+    }
+    int ret = n ? send_fds(conn, buf, len, fds, n) : 0;
+    free(buf);
+    return ret;
+}
+
+/* --takeover: collect the predecessor's listeners and clients, then wait for it to exit so its
+   journal, log and cluster/metrics ports are free; called before any of those are opened */
+static void takeover(const char *path) {
+    struct sockaddr_un sa = { .sun_family = AF_UNIX };
+    snprintf(sa.sun_path, sizeof(sa.sun_path), "%s", path);
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0) { perror("socket"); exit(1); }
+    if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) { perror("takeover connect"); exit(1); }
+
+    handoff_hdr_t h;
+    int fds[MAX_WORKERS], nfds;
+    if (recv_fds(fd, &h, sizeof(h), fds, &nfds) != (ssize_t)sizeof(h) || memcmp(h.magic, HANDOFF_MAGIC, 4) != 0) {
+        fprintf(stderr, "takeover: bad handoff header\n");
+        exit(1);
+    }
+    memcpy(inherited_listen, fds, (size_t)nfds * sizeof(int));
+    ninherited = nfds;
+    next_id = h.next_id;
+
+    char *buf = malloc(HANDOFF_MSG);
+    adopted = calloc(h.nclients ? h.nclients : 1, sizeof(*adopted));
+    if (!buf || !adopted) { perror("malloc"); exit(1); }
+    while (nadopted < h.nclients) {
+        ssize_t n = recv_fds(fd, buf, HANDOFF_MSG, fds, &nfds);
+        if (n <= 0) break; /* the predecessor gave up part way; keep what arrived */
+        size_t off = 0;
+        for (int i = 0; i < nfds; ++i) {
+            adopted_t *a = &adopted[nadopted];
+            if (nadopted == h.nclients || off + sizeof(a->rec) > (size_t)n) { close(fds[i]); continue; }
+            memcpy(&a->rec, buf + off, sizeof(a->rec));
+            off += sizeof(a->rec);
+            if (a->rec.in_len > BUF_SIZE - 1 || off + a->rec.in_len > (size_t)n) { close(fds[i]); continue; }
+            a->in = a->rec.in_len ? malloc(a->rec.in_len) : NULL;
+            if (a->in) memcpy(a->in, buf + off, a->rec.in_len);
+            else a->rec.in_len = 0;
+            off += a->rec.in_len;
+            a->rec.name[NAME_LEN - 1] = a->rec.room[NAME_LEN - 1] = '\0';
+            a->fd = fds[i];
+            nadopted++;
+        }
+    }
+    free(buf);
+    if (nadopted < h.nclients) fprintf(stderr, "takeover: got %u of %u clients\n", nadopted, h.nclients);
+    char c;
+    while (recv(fd, &c, 1, 0) > 0) { /* EOF: the old process has exited */ }
+    close(fd);
+}
+
+/* seat what takeover() received, round-robin over the workers; no welcome and no announcement */
+static void adopt_clients(void) {
+    for (int i = ninherited - 1; i >= nworkers; --i) close(inherited_listen[i]);
+    for (uint32_t i = 0; i < nadopted; ++i) {
+        adopted_t *a = &adopted[i];
+        worker_t *w = &workers[i % (uint32_t)nworkers];
+        int slot = add_client(w, a->fd, a->rec.id, a->rec.name, 0);
+        if (slot < 0) { close(a->fd); free(a->in); continue; }
+        client_t *c = client_at(w, slot);
+        client_cold_t *cc = cold_at(w, slot);
+        c->proto = a->rec.proto;
+        if ((c->deflate = a->rec.deflate && zip_min)) atomic_fetch_add(&zip_clients, 1);
+        cc->streaming = a->rec.streaming;
+        cc->greeted = a->rec.greeted;
+        if (a->rec.in_len && (cc->in = pool_get(&w->in_pool))) {
+            memcpy(cc->in, a->in, a->rec.in_len);
+            cc->in_len = a->rec.in_len;
+        }
+        free(a->in);
+        int room = room_lookup(w, a->rec.room, 1);
+        int seated = room_enter(w, slot, room >= 0 ? room : LOBBY);
+        if (room >= 0) room_unpin(room);
+        if (seated < 0) { remove_client(w, slot); continue; }
+        if (w->ring) { uring_arm_recv(w, slot); continue; }
+        struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.u64 = (uint64_t)slot };
+        if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, c->fd, &ev) < 0) { perror("epoll_ctl"); remove_client(w, slot); }
+    }
+    if (nadopted) log_event("TAKEOVER clients=%u listeners=%d", nadopted, ninherited);
+    free(adopted);
+    adopted = NULL;
+}
+
+/* --handoff: where a successor started with --takeover connects */
+static int handoff_listen(const char *path) {
+    struct sockaddr_un sa = { .sun_family = AF_UNIX };
+    snprintf(sa.sun_path, sizeof(sa.sun_path), "%s", path);
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0) { perror("socket"); exit(1); }
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) { perror("bind handoff"); exit(1); }
+    if (listen(fd, 1) < 0) { perror("listen"); exit(1); }
+    return fd;
+}
+
+static void stop_begin(int mode) {
+    atomic_store(&drain_deadline, now_ns() + (uint64_t)drain_ms * 1000000ull);
+    atomic_store(&stop_mode, mode);
+}
+
+/* The main thread after startup: SIGINT/SIGTERM arrive on a signalfd rather than in a handler, and a
+ * connection on the handoff socket starts a hot restart. Either way every worker stops accepting and
+ * drains its output (up to --drain-ms; a second signal cuts that short); for a handoff the successor
+ * then gets the listeners and clients, otherwise the clients are closed. Returns the handoff
+ * connection, or -1. */
+static int supervise(int sig_fd, int handoff_fd) {
+    int conn = -1;
+    struct pollfd pfd[2] = { { .fd = sig_fd, .events = POLLIN }, { .fd = handoff_fd, .events = POLLIN } };
+    while (atomic_load(&workers_running) > 0) {
+        int running = atomic_load(&stop_mode) == RUN;
+        int n = poll(pfd, handoff_fd >= 0 && running ? 2 : 1, running ? -1 : 10);
+        if (n < 0 && errno != EINTR) { perror("poll"); break; }
+        if (n > 0 && (pfd[0].revents & POLLIN)) {
+            struct signalfd_siginfo si;
+            if (read(sig_fd, &si, sizeof(si)) == (ssize_t)sizeof(si)) {
+#ifdef CHAT_PROFILE
+                if (si.ssi_signo == SIGUSR1) prof_dump();
+                else
+#endif
+                if (running) stop_begin(STOP_SHUTDOWN);
+                else atomic_store(&drain_deadline, 0);
+            }
+        }
+        if (n > 0 && running && handoff_fd >= 0 && (pfd[1].revents & POLLIN)) {
+            conn = accept4(handoff_fd, NULL, NULL, SOCK_CLOEXEC);
+            if (conn >= 0) stop_begin(STOP_HANDOFF);
+        }
+        /* workers check the deadline when they wake, so keep waking them until they are done */
+        uint64_t one = 1;
+        if (atomic_load(&stop_mode) != RUN)
+            for (int i = 0; i < nworkers; ++i) if (write(workers[i].wake_fd, &one, sizeof(one)) < 0) { /* already signalled */ }
+    }
+    for (int i = 0; i < nworkers; ++i) pthread_join(workers[i].thread, NULL);
+    return atomic_load(&stop_mode) == STOP_HANDOFF ? conn : -1;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [options]\n"
+                    "  -w, --workers N        event-loop threads (0 = one per CPU, default 1)\n"
+                    "  -m, --max-clients N    connections across all workers before \"Server full.\" (default %d)\n"
+                    "  -p, --port N           client port (default %d)\n"
+                    "      --backlog N        client listen backlog (default %d, capped by net.core.somaxconn)\n"
+                    "      --sndbuf BYTES     client socket send buffer (default: kernel autotuning)\n"
+                    "      --rcvbuf BYTES     client socket receive buffer (default: kernel autotuning)\n"
+                    "      --tls-cert FILE    clients speak TLS 1.2 (PEM certificate chain); records are done by kTLS\n"
+                    "      --tls-key FILE     private key (default: in the --tls-cert file)\n"
+                    "      --tls-timeout SEC  close connections that haven't finished the handshake by then (default %d)\n"
+                    "      --defer-accept SEC TCP_DEFER_ACCEPT: accept only once the client sends (binary clients; text\n"
+                    "                         clients wait for the greeting, so theirs arrives when SEC runs out)\n"
+                    "      --out-high BYTES   pending output per client before the slow policy applies (default %d)\n"
+                    "      --out-low BYTES    level a throttled client must drain to (default out-high/2)\n"
+                    "      --slow-policy P    drop-oldest | drop-newest | disconnect (default disconnect)\n"
+                    "      --log-flush F      records:N | interval:MS | shutdown (default interval:%d)\n"
+                    "      --metrics-port N   serve Prometheus text on 127.0.0.1:N (default off)\n"
+                    "      --compress-min N   deflate chat of N+ bytes for binary clients that ask (default %d, 0 = off)\n"
+                    "      --history N        chat lines kept per room and replayed on join (default %d, 0 = off)\n"
+                    "      --rate-msgs N      messages per second per client, bursts of up to N (default unlimited)\n"
+                    "      --rate-bytes N     input bytes per second per client (default unlimited)\n"
+                    "      --rate-global N    messages per second across all clients (default unlimited)\n"
+                    "      --idle-timeout SEC close connections silent that long (default 0 = off)\n"
+                    "      --ping SEC         ping clients silent that long, close them after as long again (default off)\n"
+                    "      --backend B        epoll | uring (io_uring: multishot accept/recv, batched sends; default epoll)\n"
+                    "      --journal DIR      append chat to mmap'd segment files in DIR and reload history from them\n"
+                    "      --journal-seg-mb N preallocated segment size (default %d)\n"
+                    "      --journal-dump DIR print a journal and exit\n"
+                    "      --node N           cluster mode: this node's id, 0-%d\n"
+                    "      --cluster-port N   port other nodes connect to (cluster mode)\n"
+                    "      --cluster-bind ADDR address the cluster port listens on (default 0.0.0.0); only --peer hosts are accepted\n"
+                    "      --peer N=HOST:PORT another node and its cluster port; repeat for each. A /msg to its users\n"
+                    "                         is acknowledged ([PM forwarded]) once queued, not on delivery\n"
+                    "      --drain-ms MS      on SIGINT/SIGTERM or a handoff, time allowed for queued output (default %d)\n"
+                    "      --handoff PATH     unix socket a successor connects to for a hot restart\n"
+                    "      --takeover PATH    start by taking the listeners and clients of the server at PATH\n",
+            prog, MAX_CLIENTS_DEFAULT, PORT, LISTEN_BACKLOG_DEFAULT, TLS_TIMEOUT_DEFAULT, OUT_HIGH_DEFAULT, LOG_INTERVAL_DEFAULT, ZIP_MIN_DEFAULT, HISTORY_DEFAULT, JOURNAL_SEG_DEFAULT, MAX_NODES - 1, DRAIN_MS_DEFAULT);
+}
+
+/* main */
+int main(int argc, char *argv[]) {
+    static const struct option opts[] = {
+        { "workers",     required_argument, NULL, 'w' },
+        { "max-clients", required_argument, NULL, 'm' },
+        { "port",        required_argument, NULL, 'p' },
+        { "backlog",     required_argument, NULL, 'K' },
+        { "sndbuf",      required_argument, NULL, 'O' },
+        { "rcvbuf",      required_argument, NULL, 'R' },
+        { "defer-accept", required_argument, NULL, 'A' },
+        { "tls-cert",    required_argument, NULL, 'c' },
+        { "tls-key",     required_argument, NULL, 'k' },
+        { "tls-timeout", required_argument, NULL, 'U' },
+        { "out-high",    required_argument, NULL, 'H' },
+        { "out-low",     required_argument, NULL, 'L' },
+        { "slow-policy", required_argument, NULL, 'P' },
+        { "log-flush",   required_argument, NULL, 'F' },
+        { "metrics-port", required_argument, NULL, 'M' },
+        { "history",     required_argument, NULL, 'Y' },
+        { "compress-min", required_argument, NULL, 'z' },
+        { "rate-msgs",   required_argument, NULL, 'r' },
+        { "rate-bytes",  required_argument, NULL, 'b' },
+        { "rate-global", required_argument, NULL, 'g' },
+        { "idle-timeout", required_argument, NULL, 'I' },
+        { "ping",        required_argument, NULL, 'G' },
+        { "backend",     required_argument, NULL, 'B' },
+        { "journal",     required_argument, NULL, 'J' },
+        { "journal-seg-mb", required_argument, NULL, 'S' },
+        { "journal-dump", required_argument, NULL, 'D' },
+        { "node",        required_argument, NULL, 'N' },
+        { "cluster-port", required_argument, NULL, 'C' },
+        { "cluster-bind", required_argument, NULL, 'Q' },
+        { "peer",        required_argument, NULL, 'E' },
+        { "drain-ms",    required_argument, NULL, 'T' },
+        { "handoff",     required_argument, NULL, 'X' },
+        { "takeover",    required_argument, NULL, 'Z' },
+        { "help",        no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    int ch;
+    while ((ch = getopt_long(argc, argv, "w:m:p:h", opts, NULL)) != -1) {
+        switch (ch) {
+        case 'w': nworkers = atoi(optarg); break;
+        case 'm': max_clients = atoi(optarg); break;
+        case 'p': listen_port = atoi(optarg); break;
+        case 'K': listen_backlog = atoi(optarg) > 0 ? atoi(optarg) : LISTEN_BACKLOG_DEFAULT; break;
+        case 'O': sock_sndbuf = atoi(optarg); break;
+        case 'R': sock_rcvbuf = atoi(optarg); break;
+        case 'A': defer_accept = atoi(optarg); break;
+        case 'c': tls_cert = optarg; break;
+        case 'k': tls_key = optarg; break;
+        case 'U': tls_ticks = atoi(optarg) > 0 ? (uint64_t)atoi(optarg) * 1000 / TICK_MS : tls_ticks; break;
+        case 'H': out_high = strtoul(optarg, NULL, 10); break;
+        case 'L': out_low = strtoul(optarg, NULL, 10); break;
+        case 'P':
+            if (strcmp(optarg, "drop-oldest") == 0) slow_policy = SLOW_DROP_OLDEST;
+            else if (strcmp(optarg, "drop-newest") == 0) slow_policy = SLOW_DROP_NEWEST;
+            else if (strcmp(optarg, "disconnect") == 0) slow_policy = SLOW_DISCONNECT;
+            else { usage(argv[0]); return 1; }
+            break;
+        case 'F':
+            if (strncmp(optarg, "records:", 8) == 0) { log_policy = LOG_FLUSH_RECORDS; log_flush_arg = atol(optarg + 8); }
+            else if (strncmp(optarg, "interval:", 9) == 0) { log_policy = LOG_FLUSH_INTERVAL; log_flush_arg = atol(optarg + 9); }
+            else if (strcmp(optarg, "shutdown") == 0) log_policy = LOG_FLUSH_SHUTDOWN;
+            else { usage(argv[0]); return 1; }
+            if (log_flush_arg <= 0) log_flush_arg = 1;
+            break;
+        case 'M': metrics_port = atoi(optarg); break;
+        case 'z': zip_min = atoi(optarg) > 0 ? (size_t)atoi(optarg) : 0; break;
+        case 'Y': history_len = atoi(optarg) > 0 ? atoi(optarg) : 0; break;
+        case 'r': rate_msgs = atoi(optarg) > 0 ? (uint64_t)atoi(optarg) : 0; break;
+        case 'b': rate_bytes = atoi(optarg) > 0 ? (uint64_t)atoi(optarg) : 0; break;
+        case 'g': rate_global = atoi(optarg) > 0 ? (uint64_t)atoi(optarg) : 0; break;
+        case 'I': idle_ticks = atoi(optarg) > 0 ? (uint64_t)atoi(optarg) * 1000 / TICK_MS : 0; break;
+        case 'G': ping_ticks = atoi(optarg) > 0 ? (uint64_t)atoi(optarg) * 1000 / TICK_MS : 0; break;
+        case 'B':
+            if (strcmp(optarg, "uring") == 0) backend_uring = 1;
+            else if (strcmp(optarg, "epoll") == 0) backend_uring = 0;
+            else { usage(argv[0]); return 1; }
+            break;
+        case 'J': journal_dir = optarg; break;
+        case 'S': if (atoi(optarg) > 0) journal_seg = (size_t)atoi(optarg) << 20; break;
+        case 'D': return journal_dump(optarg);
+        case 'N': node_id = atoi(optarg); break;
+        case 'C': cluster_port = atoi(optarg); break;
+        case 'Q': if (inet_pton(AF_INET, optarg, &cluster_bind) != 1) { usage(argv[0]); return 1; } break;
+        case 'E': if (peer_add(optarg) < 0) { usage(argv[0]); return 1; } break;
+        case 'T': drain_ms = atoi(optarg) >= 0 ? atoi(optarg) : DRAIN_MS_DEFAULT; break;
+        case 'X': handoff_path = optarg; break;
+        case 'Z': takeover_path = optarg; break;
+        case 'h': usage(argv[0]); return 0;
+        default:  usage(argv[0]); return 1;
+        }
+    }
+    if (nworkers <= 0) nworkers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (nworkers < 1) nworkers = 1;
+    if (nworkers > MAX_WORKERS) nworkers = MAX_WORKERS;
+    if (max_clients <= 0) max_clients = MAX_CLIENTS_DEFAULT;
+    if (out_high == 0) out_high = OUT_HIGH_DEFAULT;
+    if (out_low == 0 || out_low > out_high) out_low = out_high / 2;
+    if (node_id >= MAX_NODES || (node_id >= 0 && cluster_port <= 0) || (node_id < 0 && npeers)) { usage(argv[0]); return 1; }
+
+    /* before any thread exists, so the signals only ever reach supervise() */
+    sigset_t sigs;
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGINT);
+    sigaddset(&sigs, SIGTERM);
+#ifdef CHAT_PROFILE
+    sigaddset(&sigs, SIGUSR1); /* dump the profile */
+#endif
+    if (pthread_sigmask(SIG_BLOCK, &sigs, NULL) != 0) { perror("pthread_sigmask"); exit(1); }
+    int sig_fd = signalfd(-1, &sigs, SFD_CLOEXEC);
+    if (sig_fd < 0) { perror("signalfd"); exit(1); }
+    if (tls_cert) tls_init();
+    if (takeover_path) takeover(takeover_path);
+
+    /* aligned so each worker's counters sit on their own cache lines */
+    workers = aligned_alloc(64, (size_t)nworkers * sizeof(worker_t));
+    if (!workers) { perror("aligned_alloc"); exit(1); }
+    memset(workers, 0, (size_t)nworkers * sizeof(worker_t));
+    start_ns = now_ns();
+    for (int i = 0; i < MAX_ROOMS; ++i) pthread_mutex_init(&room_hist[i].mtx, NULL);
+    if (journal_dir) journal_open(journal_dir);
+    log_open("server.log");
+
+    dir_init((size_t)nworkers * CLIENT_CHUNK);
+    for (int i = 0; i < nworkers; ++i) worker_init(&workers[i], i);
+    adopt_clients();
+    int handoff_fd = handoff_path ? handoff_listen(handoff_path) : -1;
+    if (metrics_port > 0) metrics_start(metrics_port);
+    if (node_id >= 0) cluster_start();
+
+    printf("Chat server running on port %d with %d worker(s)...\n", listen_port, nworkers);
+
+    atomic_store(&workers_running, nworkers);
+    for (int i = 0; i < nworkers; ++i) {
+        if (pthread_create(&workers[i].thread, NULL, worker_loop, &workers[i]) != 0) { perror("pthread_create"); exit(1); }
+    }
+    int conn = supervise(sig_fd, handoff_fd);
+    if (conn >= 0 && handoff_send(conn) < 0) perror("handoff"); /* clients not yet passed on close at exit */
+
+    log_event("SERVER %s drops=%" PRIu64 " drop_bytes=%" PRIu64 " evictions=%" PRIu64 " log_drops=%" PRIu64,
+              conn >= 0 ? "HANDOFF" : "SHUTDOWN",
+              (uint64_t)atomic_load(&stat_drop_msgs), (uint64_t)atomic_load(&stat_drop_bytes),
+              (uint64_t)atomic_load(&stat_evictions), (uint64_t)atomic_load(&stat_log_drops));
+#ifdef CHAT_PROFILE
+    prof_dump();
+#endif
+    journal_close();
+    log_close();
+    return 0; /* exit closes the handoff connection, which releases the successor */
 }